@@ -124,22 +124,29 @@ in stdenv.mkDerivation (self: {
         escapeQuotesForC
       ];
 
-      default.callPackageString = ''
-        let
-          nixpkgs = builtins.getFlake "nixpkgs";
-          pkgs = import nixpkgs { };
-          callPackage = import <xil/cleanCallPackageWith> pkgs;
-        in
-          target: callPackage target { }
+      default.callPackagePkgsString = ''
+        import (builtins.getFlake "nixpkgs") { }
       '';
 
+      # Empty means --call-package is done natively, with arguments from callPackagePkgsString.
+      # For example, to go through xillib's Nix implementation instead:
+      # let
+      #   nixpkgs = builtins.getFlake "nixpkgs";
+      #   pkgs = import nixpkgs { };
+      #   callPackage = import <xil/cleanCallPackageWith> pkgs;
+      # in
+      #   target: callPackage target { }
+      default.callPackageString = "";
+
     in {
+      callPackagePkgsString ? default.callPackagePkgsString,
       callPackageString ? default.callPackageString,
     }: self.overrideAttrs (prev: {
       # We have to use preConfigure instead of `mesonFlags` directly, because `mesonFlags` can't have args
       # with spaces >.>
       preConfigure = (prev.preConfigure or "") + ''
         mesonFlagsArray+=(
+          "-Dcallpackage_pkgs=${trimAndEscape callPackagePkgsString}"
           "-Dcallpackage_fun=${trimAndEscape callPackageString}"
         )
       '';
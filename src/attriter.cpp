@@ -8,20 +8,16 @@
 
 AttrKeyValueIter::reference AttrKeyValueIter::operator*(this Self const &self)
 {
-	StdString const name = (*self.symbols)[self.current->name];
-	// We need a persistent reference, so keep this string alive in this class's vector.
-	self.referredNames.push_back(name);
+	auto const name = static_cast<StdStr>((*self.symbols)[self.current->name]);
 	nix::Value &value = *self.current->value;
-	return std::tie(self.referredNames.back(), value);
+	return {name, value};
 }
 
 AttrKeyValueIter::pointer AttrKeyValueIter::operator->(this Self &self)
 {
-	StdString const name = (*self.symbols)[self.current->name];
-	// We need a persistent reference, so keep this string alive in this class's vector.
-	self.referredNames.push_back(name);
+	auto const name = static_cast<StdStr>((*self.symbols)[self.current->name]);
 	nix::Value *value = self.current->value;
-	return std::tie(self.referredNames.back(), value);
+	return {name, value};
 }
 
 AttrKeyValueIter &AttrKeyValueIter::operator++(this Self &self)
@@ -77,14 +73,10 @@ bool operator!=(AttrKeyValueIter const &lhs, AttrKeyValueIter const &rhs) noexce
 
 OptionalRef<nix::Attr> AttrIterable::find_by_key(StdStr needle)
 {
-	for (auto &attr : *this->attrs) {
-		auto name = static_cast<StdStr>(this->symbols[attr.name]);
-		if (name == needle) {
-			return std::make_optional(std::ref(attr));
-		}
-	}
-
-	return std::nullopt;
+	// Bindings are sorted by Symbol, so intern the needle once and let Bindings binary search,
+	// instead of comparing it against the name of every attr.
+	nix::Symbol const needleSymbol = this->symbols.create(needle);
+	return make_optional_ref(this->attrs->get(needleSymbol));
 }
 
 OptionalRef<nix::Attr> AttrIterable::find_by_nested_key(nix::EvalState &state, StdSpan<StdStr> needleSpec)
@@ -18,12 +18,11 @@ struct AttrKeyValueIter : WithSelf<AttrKeyValueIter>
 {
 	using iterator_category = std::forward_iterator_tag;
 	using difference_type = ptrdiff_t;
-	using value_type = std::tuple<StdString const, nix::Value> const;
-	using pointer = std::tuple<StdString const, nix::Value *> const;
-	using reference = std::tuple<StdString const &, nix::Value &> const;
-
-	// Cursed.
-	StdVec<StdString> mutable referredNames;
+	// Names are views straight into the SymbolTable, which never moves or frees its strings,
+	// so dereferencing doesn't allocate anything.
+	using value_type = std::tuple<StdStr const, nix::Value> const;
+	using pointer = std::tuple<StdStr const, nix::Value *> const;
+	using reference = std::tuple<StdStr const, nix::Value &> const;
 
 	// Pointer means we have to define operator= ourself.
 	nix::Attr *current;
@@ -1,5 +1,6 @@
 #include "build.hpp"
 
+#include <algorithm>
 #include <cstdint>
 #include <sstream>
 #include <filesystem>
@@ -8,8 +9,6 @@
 
 // nix::KeyedBuildResult
 #include <lix/libstore/build-result.hh>
-// nix::Derivation
-#include <lix/libstore/derivations.hh>
 // nix::Realisation
 #include <lix/libstore/realisation.hh>
 
@@ -196,6 +195,34 @@ void maybeReplaceNixSymlink(nix::Store &store, stdfs::path const &target, stdfs:
 }
 
 void DrvBuilder::realizeDerivations()
+{
+	if (this->showPlan) {
+		this->printPlan();
+	}
+
+	StdVec<nix::KeyedBuildResult> results = this->state->aio.blockOn(this->store->buildPathsWithResults(this->meta.derivedPaths()));
+	assert(!results.empty());
+
+	// Now find the output paths of this build, and symlink them!
+	StdVec<PathToLink> pathsToLink;
+
+	for (nix::KeyedBuildResult &buildResult : results) {
+		for (std::pair<StdString const, nix::Realisation> &outPair : buildResult.builtOutputs) {
+			auto [name, realization] = outPair;
+			pathsToLink.emplace_back(name, this->store->printStorePath(realization.outPath));
+		}
+	}
+
+	for (auto const &[name, targetPath] : pathsToLink) {
+		StdString linkBasename = (pathsToLink.size() == 1) ? "result" : fmt::format("result-{}", name);
+		auto linkName = stdfs::current_path().append(linkBasename);
+
+		maybeReplaceNixSymlink(*this->store, targetPath, linkName);
+		eprintln("./{} -> {}", linkBasename, targetPath.string());
+	}
+}
+
+void DrvBuilder::printPlan()
 {
 	nix::StorePathSet willBuild;
 	nix::StorePathSet willSubst;
@@ -218,23 +245,8 @@ void DrvBuilder::realizeDerivations()
 	if (willBuild.size() > 0) {
 		eprintln("building {} {}:", willBuild.size(), maybePluralize(willBuild.size(), "path"));
 	}
-	for (nix::StorePath const &path : willBuild) {
-
-		nix::Derivation thisDerivation = this->state->aio.blockOn(this->store->derivationFromPath(path));
-		nix::DerivationOutputs pathOutputs = thisDerivation.outputs;
-
-		auto derivationOutputToStorePath = [&](nix::DerivationOutputs::value_type const &drvOutPair) {
-			auto [outName, derivationOutput] = drvOutPair;
-			auto drvOutPath = derivationOutput.path(
-				*this->store, thisDerivation.name, outName);
-			return this->store->printStorePath(drvOutPath.value());
-		};
-
-		auto outPaths = iter::imap(derivationOutputToStorePath, pathOutputs);
-
-		eprintln("    {} -> {}",
-			wrapInColor(this->store->printStorePath(path), AnsiFg::CYAN),
-			wrapInColorAndJoin(outPaths, ", ", AnsiFg::MAGENTA));
+	if (!willBuild.empty()) {
+		this->state->aio.blockOn(this->printWillBuild({willBuild.begin(), willBuild.end()}));
 	}
 
 	if (willSubst.size() > 0) {
@@ -255,25 +267,57 @@ void DrvBuilder::realizeDerivations()
 
 	// FIXME: what needs to happen for `unknown` to not be empty?
 	assert(unknown.empty());
+}
 
-	StdVec<nix::KeyedBuildResult> results = this->state->aio.blockOn(this->store->buildPathsWithResults(this->meta.derivedPaths()));
-	assert(!results.empty());
-
-	// Now find the output paths of this build, and symlink them!
-	StdVec<PathToLink> pathsToLink;
+kj::Promise<nix::Result<void>> DrvBuilder::printWillBuild(StdVec<nix::StorePath> willBuild)
+try {
+	// Reading thousands of .drvs one after the other is most of the wait before anything starts building,
+	// so have a few readers going at once, each taking the next path whenever it's done with one.
+	size_t next = 0;
+	size_t const readerCount = std::min(willBuild.size(), MAX_CONCURRENT_DRV_READS);
+	auto readers = kj::heapArrayBuilder<kj::Promise<nix::Result<void>>>(readerCount);
+	for (size_t i = 0; i < readerCount; ++i) {
+		readers.add(this->printWillBuildFrom(willBuild, next));
+	}
 
-	for (nix::KeyedBuildResult &buildResult : results) {
-		for (std::pair<StdString const, nix::Realisation> &outPair : buildResult.builtOutputs) {
-			auto [name, realization] = outPair;
-			pathsToLink.emplace_back(name, this->store->printStorePath(realization.outPath));
-		}
+	for (nix::Result<void> &result : co_await kj::joinPromises(readers.finish())) {
+		// Rethrows the first reader's error, if any.
+		result.value();
 	}
 
-	for (auto const &[name, targetPath] : pathsToLink) {
-		StdString linkBasename = (pathsToLink.size() == 1) ? "result" : fmt::format("result-{}", name);
-		auto linkName = stdfs::current_path().append(linkBasename);
+	co_return nix::result::success();
+} catch (...) {
+	co_return nix::result::current_exception();
+}
 
-		maybeReplaceNixSymlink(*this->store, targetPath, linkName);
-		eprintln("./{} -> {}", linkBasename, targetPath.string());
+kj::Promise<nix::Result<void>> DrvBuilder::printWillBuildFrom(StdVec<nix::StorePath> const &paths, size_t &next)
+try {
+	// All the readers run on the same event loop, so `next` only changes between awaits.
+	while (next < paths.size()) {
+		nix::StorePath const &path = paths[next];
+		next += 1;
+
+		nix::Derivation const derivation = LIX_TRY_AWAIT(this->store->derivationFromPath(path));
+		this->printWillBuildLine(path, derivation);
 	}
+
+	co_return nix::result::success();
+} catch (...) {
+	co_return nix::result::current_exception();
+}
+
+void DrvBuilder::printWillBuildLine(nix::StorePath const &path, nix::Derivation const &derivation)
+{
+	auto derivationOutputToStorePath = [&](nix::DerivationOutputs::value_type const &drvOutPair) {
+		auto [outName, derivationOutput] = drvOutPair;
+		auto drvOutPath = derivationOutput.path(
+			*this->store, derivation.name, outName);
+		return this->store->printStorePath(drvOutPath.value());
+	};
+
+	auto outPaths = iter::imap(derivationOutputToStorePath, derivation.outputs);
+
+	eprintln("    {} -> {}",
+		wrapInColor(this->store->printStorePath(path), AnsiFg::CYAN),
+		wrapInColorAndJoin(outPaths, ", ", AnsiFg::MAGENTA));
 }
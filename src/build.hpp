@@ -14,6 +14,8 @@
 #include <lix/libexpr/nixexpr.hh>
 // nix::DrvInfo
 #include <lix/libexpr/get-drvs.hh>
+// nix::Derivation
+#include <lix/libstore/derivations.hh>
 // nix::Value
 #include <lix/libexpr/value.hh>
 // nix::{DerivedPath, makeConstantStorePathRef}
@@ -30,6 +32,10 @@
 #include <lix/libutil/ref.hh>
 // nix::{Logger, ActivityId, ActivityType, ResultType, Fields}
 #include <lix/libutil/logging.hh>
+// nix::Result
+#include <lix/libutil/result.hh>
+
+#include <kj/async.h>
 
 #include <fmt/core.h>
 #include <fmt/format.h>
@@ -151,12 +157,20 @@ struct DerivationMeta
 
 struct DrvBuilder
 {
+	/** How many .drv files printPlan() reads at once. */
+	static constexpr size_t MAX_CONCURRENT_DRV_READS = 32;
+
 	std::shared_ptr<nix::EvalState> state;
 	nix::ref<nix::Store> store;
 	DerivationMeta meta;
 	nix::Logger *originalLogger;
 	XilLogger ourLogger;
 
+	/** Whether realizeDerivations() prints what it's going to build and substitute first.
+	 * Without it, nothing but the derivation being built has to be read before building starts.
+	 */
+	bool showPlan = true;
+
 	/** This constructor may throw. */
 	explicit DrvBuilder(std::shared_ptr<nix::EvalState> state, nix::ref<nix::Store> store, nix::Value &drvValue) :
 		state(state),
@@ -173,4 +187,17 @@ struct DrvBuilder
 	~DrvBuilder();
 
 	void realizeDerivations();
+
+	/** Prints what building `meta` will build and substitute. */
+	void printPlan();
+
+	/** Prints a `.drv -> outputs` line for each of `willBuild`, in whatever order their .drvs finish being read,
+	 * reading up to MAX_CONCURRENT_DRV_READS of them at once.
+	 */
+	kj::Promise<nix::Result<void>> printWillBuild(StdVec<nix::StorePath> willBuild);
+
+	/** One of printWillBuild()'s concurrent readers: reads and prints `paths[next++]` until there aren't any left. */
+	kj::Promise<nix::Result<void>> printWillBuildFrom(StdVec<nix::StorePath> const &paths, size_t &next);
+
+	void printWillBuildLine(nix::StorePath const &path, nix::Derivation const &derivation);
 };
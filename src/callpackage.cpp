@@ -0,0 +1,182 @@
+#include "callpackage.hpp"
+
+#include <set>
+
+// Lix headers.
+// nix::{AttrsPattern, ExprLambda}
+#include <lix/libexpr/nixexpr.hh>
+// nix::Suggestions
+#include <lix/libutil/suggestions.hh>
+
+#include "std/string.hpp"
+#include "std/vector.hpp"
+#include "xil.hpp"
+#include "settings.hpp"
+
+namespace
+{
+	/** The attrset package functions get their arguments from, once it's been evaluated.
+	 * Rooted, so the GC doesn't collect it out from under us.
+	 */
+	nix::RootValue cachedPkgs = nullptr;
+
+	/** `cachedPkgs`, evaluating it the first time it's needed.
+	 * Kept until forgetCallPackageArgs(), so --batch only imports nixpkgs once.
+	 */
+	nix::Value &callPackageArgs(nix::EvalState &state)
+	{
+		if (cachedPkgs == nullptr) {
+			nix::Expr &pkgsExpr = state.ctx.parseExprFromString(CALLPACKAGE_PKGS, nix::CanonPath::fromCwd());
+			nix::Value *value = state.ctx.mem.allocValue();
+			*value = nixEval(state, pkgsExpr);
+			state.forceAttrs(*value, nix::noPos, "while evaluating the attrset for --call-package");
+			cachedPkgs = nix::allocRootValue(value);
+		}
+
+		return **cachedPkgs;
+	}
+
+	/** One of a function's arguments, as lib.functionArgs sees it. */
+	struct FunctionArg
+	{
+		nix::Symbol name;
+		bool hasDefault;
+		nix::PosIdx pos;
+	};
+
+	/** Like lib.isFunction: a function, or an attrset whose `__functor` returns one. */
+	bool isFunction(nix::EvalState &state, nix::Value &value)
+	{
+		state.forceValue(value, nix::noPos);
+		if (value.type() == nix::nFunction) {
+			return true;
+		}
+		if (value.type() != nix::nAttrs) {
+			return false;
+		}
+
+		nix::Attr const *functor = value.attrs->get(state.ctx.s.functor);
+		if (functor == nullptr) {
+			return false;
+		}
+		nix::Value inner = nixCallFunction(state, *functor->value, value);
+		return isFunction(state, inner);
+	}
+
+	/** Like lib.functionArgs: a lambda's formals, or for a functor, its `__functionArgs` if it has them,
+	 * and otherwise the formals of whatever its `__functor` returns. `fun` must be a function by isFunction().
+	 */
+	StdVec<FunctionArg> functionArgs(nix::EvalState &state, nix::Value &fun)
+	{
+		StdVec<FunctionArg> args;
+
+		if (fun.isLambda()) {
+			// A function without formals (like `x: …`) gets called with an empty attrset,
+			// since that's what lib.functionArgs says it takes.
+			auto const *pattern = dynamic_cast<nix::AttrsPattern const *>(&*fun.lambda.fun->pattern);
+			if (pattern != nullptr) {
+				for (nix::AttrsPattern::Formal const &formal : pattern->formals) {
+					args.push_back(FunctionArg{.name = formal.name, .hasDefault = formal.def != nullptr, .pos = formal.pos});
+				}
+			}
+			return args;
+		}
+
+		if (fun.type() != nix::nAttrs) {
+			// Primops, which builtins.functionArgs says don't take anything either.
+			return args;
+		}
+
+		if (nix::Attr const *declared = fun.attrs->get(state.ctx.symbols.create("__functionArgs"))) {
+			state.forceAttrs(*declared->value, declared->pos, "while evaluating the __functionArgs of the --call-package target");
+			for (nix::Attr const &attr : *declared->value->attrs) {
+				bool const hasDefault = state.forceBool(
+					*attr.value,
+					attr.pos,
+					"while evaluating whether a --call-package argument has a default"
+				);
+				args.push_back(FunctionArg{.name = attr.name, .hasDefault = hasDefault, .pos = attr.pos});
+			}
+			return args;
+		}
+
+		nix::Attr const *functor = fun.attrs->get(state.ctx.s.functor);
+		nix::Value inner = nixCallFunction(state, *functor->value, fun);
+		return functionArgs(state, inner);
+	}
+
+	[[noreturn]]
+	void throwMissingArgument(nix::EvalState &state, nix::Value &pkgs, FunctionArg const &arg)
+	{
+		auto const name = static_cast<StdStr>(state.ctx.symbols[arg.name]);
+
+		// Only now is it worth looking through every name in `pkgs`.
+		std::set<StdString> possibilities;
+		for (nix::Attr const &attr : *pkgs.attrs) {
+			possibilities.emplace(state.ctx.symbols[attr.name]);
+		}
+		auto suggestions = nix::Suggestions::bestMatches(possibilities, name).trim(3, 2);
+
+		state.ctx.errors.make<nix::EvalError>(
+			"function called without required argument '%s'",
+			name
+		).withSuggestions(suggestions).atPos(arg.pos).debugThrow();
+	}
+}
+
+void forgetCallPackageArgs()
+{
+	cachedPkgs = nullptr;
+}
+
+bool isCallPackageTarget(nix::EvalState &state, nix::Value &value)
+{
+	state.forceValue(value, nix::noPos);
+	return value.type() == nix::nPath || isFunction(state, value);
+}
+
+nix::Value callPackage(nix::EvalState &state, nix::Value &targetValue)
+{
+	// Use the user-specified expression for "call package", if there is one.
+	if (StdStr{CALLPACKAGE_FUN}.empty() == false) {
+		nix::Expr &callPackageExpr = state.ctx.parseExprFromString(CALLPACKAGE_FUN, nix::CanonPath::fromCwd());
+		nix::Value callPackage = nixEval(state, callPackageExpr);
+		return nixCallFunction(state, callPackage, targetValue);
+	}
+
+	// Like callPackage, a path is the file to import the function from.
+	state.forceValue(targetValue, nix::noPos);
+	nix::Value fun = targetValue;
+	if (fun.type() == nix::nPath) {
+		nix::Value importFun = nixEval(state, state.ctx.parseExprFromString("import", nix::CanonPath::fromCwd()));
+		fun = nixCallFunction(state, importFun, targetValue);
+	}
+
+	// `xil build -C` calls this on whatever the target is, so this might be something we can't call.
+	if (!isFunction(state, fun)) {
+		state.ctx.errors.make<nix::TypeError>(
+			"--call-package needs a function, but the target is %s",
+			nix::showType(fun)
+		).debugThrow();
+	}
+	nix::Value &pkgs = callPackageArgs(state);
+	auto const formals = functionArgs(state, fun);
+
+	auto args = state.ctx.buildBindings(formals.size());
+	for (FunctionArg const &formal : formals) {
+		if (nix::Attr const *found = pkgs.attrs->get(formal.name)) {
+			args.insert(formal.name, found->value);
+		} else if (!formal.hasDefault) {
+			throwMissingArgument(state, pkgs, formal);
+		}
+		// Otherwise the function's default gets used.
+	}
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+	nix::Value argsValue;
+#pragma clang diagnostic pop
+	argsValue.mkAttrs(args);
+
+	return nixCallFunction(state, fun, argsValue);
+}
@@ -0,0 +1,29 @@
+// --call-package.
+
+#pragma once
+
+// Lix headers.
+#include <lix/config.h> // IWYU pragma: keep
+// nix::EvalState
+#include <lix/libexpr/eval.hh>
+// nix::Value
+#include <lix/libexpr/value.hh>
+
+/** Calls a package function the way nixpkgs' callPackage would, with its arguments taken from `CALLPACKAGE_PKGS`,
+ * or through the `CALLPACKAGE_FUN` expression instead if one was configured.
+ *
+ * Natively, this is the same as xillib's cleanCallPackageWith, without any of the Nix-level lib pipeline:
+ * the function's formals are looked up in `pkgs` by Symbol, and the call is one attrset construction.
+ * Like there, a path target is imported first, and functors' arguments are found like lib.functionArgs does.
+ * Suggestions for a missing argument are only searched for when there is one.
+ */
+nix::Value callPackage(nix::EvalState &state, nix::Value &targetValue);
+
+/** Forget the arguments callPackage() evaluated, which belong to the evaluator they were evaluated with.
+ * Call before switching to a different one.
+ */
+void forgetCallPackageArgs();
+
+/** Whether `value` is something callPackage() can call: a function, a functor, or a path to import one from. */
+[[nodiscard]]
+bool isCallPackageTarget(nix::EvalState &state, nix::Value &value);
@@ -0,0 +1,422 @@
+#include "daemon.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <iostream>
+#include <thread>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Lix headers.
+#include <lix/config.h> // IWYU pragma: keep
+// nix::{Error, SysError}
+#include <lix/libutil/error.hh>
+// nix::{checkInterrupt, triggerInterrupt, Interrupted, _isInterrupted}
+#include <lix/libutil/signals.hh>
+
+#include <fmt/format.h>
+
+#include "fdio.hpp"
+#include "xil.hpp"
+
+namespace stdfs = std::filesystem;
+
+namespace
+{
+	// What clients hand over: stdin, stdout, and stderr.
+	constexpr size_t PASSED_FDS = 3;
+
+	// What our end of the socket is called in errors.
+	constexpr StdStr SOCKET_WHAT = "xil daemon socket";
+
+	// What the daemon tells a client before running its command, or instead of it.
+	constexpr char REPLY_RUNNING = 'r';
+	constexpr char REPLY_DIFFERENT_ENVIRONMENT = 'e';
+
+	/** The parts of the environment that change how Nix evaluates things (NIX_PATH, NIX_CONFIG, where nix.conf is, …),
+	 * so a client can tell whether the daemon would evaluate its command the same way it would have.
+	 */
+	StdString nixEnvironment()
+	{
+		StdVec<StdStr> vars;
+		for (char **var = environ; *var != nullptr; ++var) {
+			StdStr const entry{*var};
+			if (entry.starts_with("NIX_") || entry.starts_with("XDG_CONFIG_") || entry.starts_with("HOME=")) {
+				vars.push_back(entry);
+			}
+		}
+		std::ranges::sort(vars);
+
+		StdString result;
+		for (StdStr const var : vars) {
+			result.append(var);
+			result.push_back('\0');
+		}
+		return result;
+	}
+
+	/** A Unix stream socket that anything we exec won't inherit. */
+	OwnedFd unixSocket()
+	{
+		OwnedFd fd{socket(AF_UNIX, SOCK_STREAM, 0)};
+		if (fd.fd >= 0) {
+			setCloseOnExec(fd.fd);
+		}
+		return fd;
+	}
+
+	sockaddr_un socketAddress(StdStr socketPath)
+	{
+		sockaddr_un addr{};
+		addr.sun_family = AF_UNIX;
+		if (socketPath.size() >= sizeof(addr.sun_path)) {
+			throw nix::Error("socket path '%s' is too long", socketPath);
+		}
+		std::memcpy(addr.sun_path, socketPath.data(), socketPath.size());
+		return addr;
+	}
+
+	/** Sends our stdin, stdout, and stderr along with a single byte, since SCM_RIGHTS needs some data to ride on. */
+	void sendStdFds(int socketFd)
+	{
+		std::array<int, PASSED_FDS> fds = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+		char marker = 'x';
+		iovec iov{.iov_base = &marker, .iov_len = 1};
+
+		alignas(cmsghdr) std::array<char, CMSG_SPACE(sizeof(fds))> control{};
+		msghdr msg{};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.data();
+		msg.msg_controllen = control.size();
+
+		cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+		std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(fds));
+
+		if (sendmsg(socketFd, &msg, 0) < 0) {
+			throw nix::SysError("sending file descriptors to xil daemon");
+		}
+	}
+
+	std::array<int, PASSED_FDS> receiveStdFds(int socketFd)
+	{
+		char marker;
+		iovec iov{.iov_base = &marker, .iov_len = 1};
+
+		alignas(cmsghdr) std::array<char, CMSG_SPACE(sizeof(int) * PASSED_FDS)> control{};
+		msghdr msg{};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.data();
+		msg.msg_controllen = control.size();
+
+		if (recvmsg(socketFd, &msg, 0) <= 0) {
+			throw nix::SysError("receiving file descriptors from xil client");
+		}
+
+		cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		if (cmsg == nullptr || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * PASSED_FDS)) {
+			throw nix::Error("xil client did not send its stdin, stdout, and stderr");
+		}
+
+		std::array<int, PASSED_FDS> fds;
+		std::memcpy(fds.data(), CMSG_DATA(cmsg), sizeof(int) * PASSED_FDS);
+		for (int const fd : fds) {
+			setCloseOnExec(fd);
+		}
+		return fds;
+	}
+
+	/** Forgets that stdin has hit EOF, since the next one to be swapped in is a different file. */
+	void resetStdin()
+	{
+		std::cin.clear();
+		std::clearerr(stdin);
+	}
+
+	/** Flushes everything that might be buffered for our current stdout and stderr. */
+	void flushStdStreams()
+	{
+		std::cout.flush();
+		std::cerr.flush();
+		std::fflush(stdout);
+		std::fflush(stderr);
+	}
+
+	/** Interrupts the command a client is running if the client goes away, like from a ^C.
+	 *
+	 * Clients don't send anything after their command, so their socket only becomes readable once they close it.
+	 * Like ^C, this goes through nix::triggerInterrupt(), which raises the flag nix::checkInterrupt() checks.
+	 */
+	struct HangupWatch
+	{
+		explicit HangupWatch(int clientFd) : clientFd(clientFd)
+		{
+			int fds[2];
+			if (pipe(fds) < 0) {
+				throw nix::SysError("creating pipe for xil daemon");
+			}
+			this->stopRead.reset(fds[0]);
+			this->stopWrite.reset(fds[1]);
+			setCloseOnExec(this->stopRead.fd);
+			setCloseOnExec(this->stopWrite.fd);
+			this->watcher = std::thread([this]() { this->watch(); });
+		}
+
+		HangupWatch(HangupWatch const &) = delete;
+		HangupWatch &operator=(HangupWatch const &) = delete;
+
+		~HangupWatch()
+		{
+			this->stop();
+		}
+
+		/** Stops watching.
+		 * Returns true if the client hung up, in which case the interrupt flag is cleared,
+		 * since the interrupt was theirs and not ours.
+		 */
+		bool stop()
+		{
+			if (this->watcher.joinable()) {
+				char const wake = 'x';
+				[[maybe_unused]] auto const written = write(this->stopWrite.fd, &wake, 1);
+				this->watcher.join();
+			}
+
+			if (!this->hungUp) {
+				return false;
+			}
+			nix::_isInterrupted = false;
+			return true;
+		}
+
+	private:
+		int clientFd;
+		OwnedFd stopRead;
+		OwnedFd stopWrite;
+		std::atomic<bool> hungUp = false;
+		std::thread watcher;
+
+		void watch()
+		{
+			std::array<pollfd, 2> pfds = {
+				pollfd{.fd = this->clientFd, .events = POLLIN, .revents = 0},
+				pollfd{.fd = this->stopRead.fd, .events = POLLIN, .revents = 0},
+			};
+			while (poll(pfds.data(), pfds.size(), -1) < 0) {
+				if (errno != EINTR) {
+					return;
+				}
+			}
+
+			if (pfds[1].revents == 0 && pfds[0].revents != 0) {
+				this->hungUp = true;
+				// Through triggerInterrupt() rather than the flag itself, so a ForceDeadline knows it wasn't just it.
+				nix::triggerInterrupt();
+			}
+		}
+	};
+
+	/** Runs one client's command. */
+	void serveClient(int clientFd, DaemonHandler const &handler)
+	{
+		auto const clientFds = receiveStdFds(clientFd);
+		OwnedFd clientStdin{clientFds[0]};
+		OwnedFd clientStdout{clientFds[1]};
+		OwnedFd clientStderr{clientFds[2]};
+
+		uint32_t argc;
+		readAll(clientFd, &argc, sizeof(argc), SOCKET_WHAT);
+		StdVec<StdString> argv;
+		argv.reserve(argc);
+		for ([[maybe_unused]] uint32_t i = 0; i < argc; ++i) {
+			argv.push_back(readFrame(clientFd, SOCKET_WHAT));
+		}
+		StdString const clientCwd = readFrame(clientFd, SOCKET_WHAT);
+
+		// We've long since read all our settings, so a client with different ones would get the wrong results.
+		if (readFrame(clientFd, SOCKET_WHAT) != nixEnvironment()) {
+			writeAll(clientFd, &REPLY_DIFFERENT_ENVIRONMENT, 1, SOCKET_WHAT);
+			return;
+		}
+		writeAll(clientFd, &REPLY_RUNNING, 1, SOCKET_WHAT);
+
+		// Swap the client's standard streams in for ours, for as long as its command runs.
+		flushStdStreams();
+		OwnedFd ourStdin{dup(STDIN_FILENO)};
+		OwnedFd ourStdout{dup(STDOUT_FILENO)};
+		OwnedFd ourStderr{dup(STDERR_FILENO)};
+		dup2(clientStdin.fd, STDIN_FILENO);
+		dup2(clientStdout.fd, STDOUT_FILENO);
+		dup2(clientStderr.fd, STDERR_FILENO);
+		// Otherwise everyone after the first client to read stdin to the end, like with --batch -, would get nothing.
+		resetStdin();
+
+		auto const ourCwd = stdfs::current_path();
+
+		int32_t exitCode = 1;
+		HangupWatch hangup{clientFd};
+		try {
+			stdfs::current_path(clientCwd);
+			exitCode = handler(argv);
+		} catch (nix::Interrupted &) {
+			if (!hangup.stop()) {
+				// That's our ^C, not theirs.
+				flushStdStreams();
+				dup2(ourStdin.fd, STDIN_FILENO);
+				dup2(ourStdout.fd, STDOUT_FILENO);
+				dup2(ourStderr.fd, STDERR_FILENO);
+				stdfs::current_path(ourCwd);
+				throw;
+			}
+		} catch (nix::Error &ex) {
+			eprintln("{}", ex.msg());
+		} catch (std::exception &ex) {
+			eprintln("error: {}", ex.what());
+		}
+
+		// The command might have caught the client's interrupt itself, so check either way.
+		bool const clientGone = hangup.stop();
+
+		flushStdStreams();
+		dup2(ourStdin.fd, STDIN_FILENO);
+		dup2(ourStdout.fd, STDOUT_FILENO);
+		dup2(ourStderr.fd, STDERR_FILENO);
+		stdfs::current_path(ourCwd);
+		resetStdin();
+
+		if (clientGone) {
+			// There's nobody left to tell.
+			return;
+		}
+
+		writeAll(clientFd, &exitCode, sizeof(exitCode), SOCKET_WHAT);
+	}
+}
+
+StdString defaultDaemonSocketPath()
+{
+	if (char const *runtimeDir = std::getenv("XDG_RUNTIME_DIR")) {
+		return fmt::format("{}/xil.sock", runtimeDir);
+	}
+	return fmt::format("/tmp/xil-{}.sock", getuid());
+}
+
+int serveDaemon(StdStr socketPath, DaemonHandler const &handler)
+{
+	OwnedFd listenFd = unixSocket();
+	if (listenFd.fd < 0) {
+		throw nix::SysError("creating xil daemon socket");
+	}
+
+	auto const addr = socketAddress(socketPath);
+	StdString const path{socketPath};
+
+	// A socket left over from a daemon that didn't clean up would otherwise make bind() fail.
+	unlink(path.c_str());
+
+	// Only we get to talk to our daemon.
+	auto const oldUmask = umask(0077);
+	int const bound = bind(listenFd.fd, reinterpret_cast<sockaddr const *>(&addr), sizeof(addr));
+	umask(oldUmask);
+	if (bound < 0) {
+		throw nix::SysError("binding xil daemon socket to '%s'", path);
+	}
+
+	if (listen(listenFd.fd, 16) < 0) {
+		throw nix::SysError("listening on xil daemon socket");
+	}
+
+	// A client's output going away, like if it's ^C'd while piped into something, shouldn't kill the daemon.
+	SigpipeIgnored sigpipeIgnored;
+
+	eprintln("xil daemon listening on {}", path);
+
+	try {
+		while (true) {
+			// Wake up every so often so ^C gets noticed.
+			pollfd pfd{.fd = listenFd.fd, .events = POLLIN, .revents = 0};
+			int const ready = poll(&pfd, 1, 500);
+			nix::checkInterrupt();
+			if (ready <= 0) {
+				continue;
+			}
+
+			OwnedFd clientFd{accept(listenFd.fd, nullptr, nullptr)};
+			if (clientFd.fd < 0) {
+				continue;
+			}
+			setCloseOnExec(clientFd.fd);
+
+			try {
+				serveClient(clientFd.fd, handler);
+			} catch (nix::Interrupted &) {
+				throw;
+			} catch (std::exception &ex) {
+				// A client going away shouldn't take the daemon with it.
+				eprintln("xil daemon: {}", ex.what());
+			}
+		}
+	} catch (nix::Interrupted &) {
+		eprintln("xil daemon shutting down");
+	}
+
+	unlink(path.c_str());
+	return 0;
+}
+
+StdOpt<int> runViaDaemon(StdStr socketPath, int argc, char *argv[])
+{
+	OwnedFd socketFd = unixSocket();
+	if (socketFd.fd < 0) {
+		eprintln("warning: couldn't connect to xil daemon at {}", socketPath);
+		return std::nullopt;
+	}
+
+	auto const addr = socketAddress(socketPath);
+	if (connect(socketFd.fd, reinterpret_cast<sockaddr const *>(&addr), sizeof(addr)) < 0) {
+		eprintln("warning: couldn't connect to xil daemon at {}", socketPath);
+		return std::nullopt;
+	}
+
+	// If the daemon goes away, we want to hear about it from write(2), not be killed for it.
+	SigpipeIgnored sigpipeIgnored;
+
+	sendStdFds(socketFd.fd);
+
+	auto const count = static_cast<uint32_t>(argc);
+	writeAll(socketFd.fd, &count, sizeof(count), SOCKET_WHAT);
+	for (int i = 0; i < argc; ++i) {
+		writeFrame(socketFd.fd, argv[i], SOCKET_WHAT);
+	}
+	writeFrame(socketFd.fd, stdfs::current_path().string(), SOCKET_WHAT);
+	writeFrame(socketFd.fd, nixEnvironment(), SOCKET_WHAT);
+
+	char reply;
+	readAll(socketFd.fd, &reply, 1, SOCKET_WHAT);
+	if (reply == REPLY_DIFFERENT_ENVIRONMENT) {
+		eprintln("warning: xil daemon at {} was started with different Nix environment variables", socketPath);
+		return std::nullopt;
+	}
+
+	// All the output goes straight to our stdout and stderr, so all that's left is the exit code.
+	// If we're ^C'd while waiting, the daemon sees us hang up and interrupts the command.
+	int32_t exitCode;
+	readAll(socketFd.fd, &exitCode, sizeof(exitCode), SOCKET_WHAT);
+	return exitCode;
+}
@@ -0,0 +1,33 @@
+// `xil daemon`, and talking to it.
+
+#pragma once
+
+#include <functional>
+
+#include "std/optional.hpp"
+#include "std/string.hpp"
+#include "std/string_view.hpp"
+#include "std/vector.hpp"
+
+/** Where `xil daemon` listens, and where clients look for it, if not otherwise specified. */
+StdString defaultDaemonSocketPath();
+
+/** Runs a command for a client, given its argv, and returns the exit code. */
+using DaemonHandler = std::function<int(StdVec<StdString> &argv)>;
+
+/** Listens on `socketPath` and runs `handler` for each client, one at a time, until interrupted.
+ *
+ * Clients hand us their stdin, stdout, and stderr, which are swapped in for ours while their command
+ * runs, so output goes straight to them (TTY detection and all), and we never have to proxy it.
+ * Commands also run in the client's working directory.
+ * If a client hangs up partway through, like from a ^C, its command is interrupted.
+ * Clients whose Nix environment variables (NIX_PATH, NIX_CONFIG, …) differ from ours are turned away,
+ * since we read all of those when we started.
+ */
+int serveDaemon(StdStr socketPath, DaemonHandler const &handler);
+
+/** Has the daemon at `socketPath` run this command for us.
+ * Returns the command's exit code, or std::nullopt (after saying why) if there's no daemon to connect to,
+ * or it can't run this command for us. Throws if the daemon goes away partway through.
+ */
+StdOpt<int> runViaDaemon(StdStr socketPath, int argc, char *argv[]);
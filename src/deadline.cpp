@@ -0,0 +1,75 @@
+#include "deadline.hpp"
+
+// Lix headers.
+#include <lix/config.h> // IWYU pragma: keep
+// nix::{_isInterrupted, createInterruptCallback}
+#include <lix/libutil/signals.hh>
+
+ForceDeadline::ForceDeadline(Clock::duration timeout) :
+	timeout(timeout),
+	// Our own interrupts don't go through nix::triggerInterrupt(), so this only hears about everyone else's.
+	interruptCallback(nix::createInterruptCallback([this]() { this->interruptedElsewhere = true; })),
+	watchdog([this]() { this->watch(); })
+{ }
+
+ForceDeadline::~ForceDeadline()
+{
+	{
+		std::lock_guard lock(this->mutex);
+		this->stopping = true;
+	}
+	this->wakeup.notify_one();
+	this->watchdog.join();
+}
+
+void ForceDeadline::arm()
+{
+	{
+		std::lock_guard lock(this->mutex);
+		this->deadline = Clock::now() + this->timeout;
+		this->expired = false;
+		this->interruptedElsewhere = false;
+	}
+	this->wakeup.notify_one();
+}
+
+bool ForceDeadline::disarm()
+{
+	std::lock_guard lock(this->mutex);
+	this->deadline = std::nullopt;
+
+	if (!this->expired) {
+		return false;
+	}
+
+	this->expired = false;
+	if (this->interruptedElsewhere) {
+		// Someone else wants us to stop too, and that's not ours to take back.
+		return false;
+	}
+
+	// That was only us, not a ^C, so don't leave the rest of the run thinking it's been interrupted.
+	nix::_isInterrupted = false;
+	return true;
+}
+
+void ForceDeadline::watch()
+{
+	std::unique_lock lock(this->mutex);
+	while (!this->stopping) {
+		if (!this->deadline.has_value()) {
+			this->wakeup.wait(lock);
+			continue;
+		}
+
+		auto const until = this->deadline.value();
+		this->wakeup.wait_until(lock, until);
+
+		// We might have been disarmed or re-armed while we were waiting.
+		if (this->deadline == until && Clock::now() >= until) {
+			this->deadline = std::nullopt;
+			this->expired = true;
+			nix::_isInterrupted = true;
+		}
+	}
+}
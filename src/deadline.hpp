@@ -0,0 +1,65 @@
+// Wall-clock time limits for forcing values.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// Lix headers.
+#include <lix/config.h> // IWYU pragma: keep
+// nix::InterruptCallback
+#include <lix/libutil/signals.hh>
+
+#include "std/optional.hpp"
+
+/** Interrupts evaluation once a deadline passes, through the same flag nix::checkInterrupt() checks for ^C.
+ *
+ * Lix doesn't have any way to bound how long forcing a value takes, but the evaluator does call
+ * nix::checkInterrupt() regularly, so a watchdog thread raising the interrupt flag gets us
+ * a nix::Interrupted thrown from wherever evaluation happens to be.
+ * `disarm()` tells the caller whether that Interrupted was only us, or the user (or anything else
+ * that interrupts through nix::triggerInterrupt()) too.
+ */
+struct ForceDeadline
+{
+	using Clock = std::chrono::steady_clock;
+
+	Clock::duration timeout;
+
+	explicit ForceDeadline(Clock::duration timeout);
+
+	// The watchdog thread has a pointer to us.
+	ForceDeadline(ForceDeadline const &) = delete;
+	ForceDeadline &operator=(ForceDeadline const &) = delete;
+
+	~ForceDeadline();
+
+	/** Start the clock. Evaluation will be interrupted `timeout` from now, unless `disarm()`ed first. */
+	void arm();
+
+	/** Stop the clock.
+	 * Returns true if the deadline had already passed and nothing else has asked to interrupt since we were armed,
+	 * in which case the interrupt flag is cleared, since the interrupt was only ours.
+	 */
+	bool disarm();
+
+private:
+	std::mutex mutex;
+	std::condition_variable wakeup;
+	StdOpt<Clock::time_point> deadline;
+	bool expired = false;
+	bool stopping = false;
+
+	// Set by anything else interrupting, so we know not to clear the flag out from under it.
+	std::atomic<bool> interruptedElsewhere = false;
+	std::unique_ptr<nix::InterruptCallback> interruptCallback;
+
+	// Declared last so everything it uses is constructed before it starts.
+	std::thread watchdog;
+
+	void watch();
+};
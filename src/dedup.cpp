@@ -0,0 +1,150 @@
+#include "dedup.hpp"
+
+#include <algorithm>
+
+namespace
+{
+	// For TextHash. Any odd numbers will do, since the arithmetic is all mod 2^64.
+	constexpr uint64_t HASH_BASE = 0x100000001B3;
+	constexpr uint64_t NEWLINE_TOKEN = 0x1000;
+	constexpr uint64_t SPACE_WEIGHT = 0x9E3779B97F4A7C15;
+
+	/** Takes the next line off the front of `text`, minus up to `indent` leading spaces unless it's the `first`. */
+	StdStr takeLine(StdStr &text, size_t indent, bool first)
+	{
+		size_t const newline = text.find('\n');
+		size_t const length = (newline == StdStr::npos) ? text.size() : newline + 1;
+		StdStr line = text.substr(0, length);
+		text.remove_prefix(length);
+
+		if (!first) {
+			line.remove_prefix(std::min({indent, line.find_first_not_of(' '), line.size()}));
+		}
+		return line;
+	}
+
+	/** Whether `a` and `b` are the same, minus up to `aIndent` and `bIndent` leading spaces on every line but the first.
+	 * Every line of a printed subtree is indented at least as far as it is, so this compares identical subtrees
+	 * printed at different depths as the same.
+	 */
+	bool sameUnindented(StdStr a, size_t aIndent, StdStr b, size_t bIndent)
+	{
+		for (bool first = true; !a.empty() || !b.empty(); first = false) {
+			if (takeLine(a, aIndent, first) != takeLine(b, bIndent, first)) {
+				return false;
+			}
+		}
+		return true;
+	}
+}
+
+SubtreeDedup::TextHash SubtreeDedup::TextHash::of(StdStr text)
+{
+	TextHash result;
+	for (size_t index = 0; index < text.size(); ) {
+		uint64_t token;
+		bool const newline = text[index] == '\n';
+		if (newline) {
+			size_t const lineStart = index + 1;
+			size_t const spaces = std::min(text.find_first_not_of(' ', lineStart), text.size()) - lineStart;
+			token = NEWLINE_TOKEN + SPACE_WEIGHT * spaces;
+			index = lineStart + spaces;
+		} else {
+			token = static_cast<unsigned char>(text[index]) + 1;
+			index += 1;
+		}
+
+		result.hash = result.hash * HASH_BASE + token;
+		result.newlines = result.newlines * HASH_BASE + (newline ? 1 : 0);
+		result.power *= HASH_BASE;
+	}
+	return result;
+}
+
+void SubtreeDedup::TextHash::append(TextHash const &next) noexcept
+{
+	this->hash = this->hash * next.power + next.hash;
+	this->newlines = this->newlines * next.power + next.newlines;
+	this->power *= next.power;
+}
+
+uint64_t SubtreeDedup::TextHash::unindented(size_t indent) const noexcept
+{
+	// Each newline token with `indent` fewer spaces after it is `SPACE_WEIGHT * indent` less.
+	return this->hash - SPACE_WEIGHT * indent * this->newlines;
+}
+
+StdOpt<StdString> SubtreeDedup::findOrRemember(size_t offset, size_t indent, StdStr path)
+{
+	StdStr const buffer = this->buffer.view();
+	StdStr const text = buffer.substr(offset);
+	if (text.size() < MIN_SIZE) {
+		return std::nullopt;
+	}
+
+	// Everything remembered from `offset` on is inside this subtree, and the last of them is its last direct child.
+	// Step back through its direct children, over anything inside them, so only the text between them gets hashed here.
+	StdVec<size_t> children;
+	size_t firstInside = this->subtrees.size();
+	for (size_t index = this->subtrees.size(); index > 0 && this->subtrees[index - 1].offset >= offset; ) {
+		children.push_back(index - 1);
+		firstInside = this->subtrees[index - 1].firstInside;
+		index = firstInside;
+	}
+
+	TextHash textHash;
+	size_t position = offset;
+	for (auto it = children.rbegin(); it != children.rend(); ++it) {
+		Subtree const &child = this->subtrees[*it];
+		textHash.append(TextHash::of(buffer.substr(position, child.offset - position)));
+		textHash.append(child.text);
+		position = child.offset + child.length;
+	}
+	textHash.append(TextHash::of(buffer.substr(position)));
+	uint64_t const hash = textHash.unindented(indent);
+
+	auto const [first, last] = this->byHash.equal_range(hash);
+	for (auto it = first; it != last; ++it) {
+		Subtree const &earlier = this->subtrees[it->second];
+		StdStr const earlierText = buffer.substr(earlier.offset, earlier.length);
+		if (!sameUnindented(text, indent, earlierText, earlier.indent)) {
+			continue;
+		}
+
+		// Found one. Copy the path out before forgetting anything, which might be it.
+		StdString earlierPath = earlier.path;
+		this->references += 1;
+		this->bytesSaved += text.size();
+		this->forgetFrom(offset);
+		this->buffer.truncate(offset);
+		return earlierPath;
+	}
+
+	this->byHash.emplace(hash, this->subtrees.size());
+	this->subtrees.push_back(Subtree{
+		.offset = offset,
+		.length = text.size(),
+		.indent = indent,
+		.text = textHash,
+		.hash = hash,
+		.firstInside = firstInside,
+		.path = StdString{path},
+	});
+	return std::nullopt;
+}
+
+void SubtreeDedup::forgetFrom(size_t offset)
+{
+	// Only whatever's inside the subtree being taken back can be past it, and that's all at the end.
+	while (!this->subtrees.empty() && this->subtrees.back().offset >= offset) {
+		size_t const index = this->subtrees.size() - 1;
+		auto const [first, last] = this->byHash.equal_range(this->subtrees.back().hash);
+		for (auto it = first; it != last; ++it) {
+			if (it->second == index) {
+				this->byHash.erase(it);
+				break;
+			}
+		}
+		this->subtrees.pop_back();
+	}
+}
@@ -0,0 +1,89 @@
+// Finding subtrees Printer has already printed, for --dedup.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+
+#include "output.hpp"
+#include "std/optional.hpp"
+#include "std/string.hpp"
+#include "std/string_view.hpp"
+#include "std/vector.hpp"
+
+/** Remembers every attrset and list Printer has finished printing, by what it printed as,
+ * so later ones that print exactly the same can be replaced with a reference to the first.
+ *
+ * Everything has to be printed into `buffer` for this, so earlier subtrees can be compared against,
+ * and so a repeated subtree can be taken back out once we find out it's a repeat.
+ *
+ * Subtrees are compared as printed, ignoring how far they're indented,
+ * so this catches separately allocated but identical things (`meta.platforms`, licenses, …)
+ * that `Printer::seen` can't.
+ */
+struct SubtreeDedup
+{
+	// Anything smaller isn't worth replacing with a reference.
+	static constexpr size_t MIN_SIZE = 64;
+
+	StringSink buffer;
+
+	/** How many subtrees were replaced with references. */
+	size_t references = 0;
+
+	/** Bytes of output those references saved. */
+	size_t bytesSaved = 0;
+
+	/** Call when a subtree that started at `offset` into `buffer`, `indent` spaces in, has just been printed.
+	 * If an identical subtree was printed before, takes this one back out of `buffer`, and returns the first one's path.
+	 * Otherwise, remembers this one as being at `path`.
+	 */
+	StdOpt<StdString> findOrRemember(size_t offset, size_t indent, StdStr path);
+
+private:
+	/** A hash of printed text in which each newline and the spaces after it count as one token,
+	 * so the same text indented differently hashes differently only by a multiple of `newlines`,
+	 * and the hashes of two pieces of text can be combined into the hash of both.
+	 * That way each subtree's hash is put together from its children's, instead of rehashing all of its text.
+	 */
+	struct TextHash
+	{
+		uint64_t hash = 0;
+		// Like `hash`, but of 1 for each newline token and 0 for any other.
+		uint64_t newlines = 0;
+		// The hash's base to the power of how many tokens it's of.
+		uint64_t power = 1;
+
+		[[nodiscard]]
+		static TextHash of(StdStr text);
+
+		void append(TextHash const &next) noexcept;
+
+		/** The hash of the text with `indent` spaces taken off every line but the first. */
+		[[nodiscard]]
+		uint64_t unindented(size_t indent) const noexcept;
+	};
+
+	struct Subtree
+	{
+		size_t offset;
+		size_t length;
+		size_t indent;
+		TextHash text;
+		// `text.unindented(indent)`, which is what `byHash` has it under.
+		uint64_t hash;
+		// Index into `subtrees` of the first subtree inside this one, or its own if there isn't one.
+		size_t firstInside;
+		StdString path;
+	};
+
+	// In the order they finished printing, which means anything inside a subtree comes right before it.
+	StdVec<Subtree> subtrees;
+
+	// Hash to index into `subtrees`.
+	std::unordered_multimap<uint64_t, size_t> byHash;
+
+	/** Forget everything printed from `offset` on, since it's no longer in `buffer`. */
+	void forgetFrom(size_t offset);
+};
@@ -0,0 +1,157 @@
+#include "evaljobs.hpp"
+
+// Lix headers.
+#include <lix/libexpr/attr-set.hh>
+// nix::DrvInfo
+#include <lix/libexpr/get-drvs.hh>
+// nix::noPos
+#include <lix/libexpr/nixexpr.hh>
+// nix::Store
+#include <lix/libstore/store-api.hh>
+// nix::checkInterrupt
+#include <lix/libutil/signals.hh>
+
+#include "attriter.hpp"
+#include "output.hpp"
+#include "xil.hpp"
+
+using namespace std::literals::string_literals;
+
+JobLister::JobLister(nix::ref<nix::EvalState> state) :
+	state(state),
+	recurseSymbol(state->ctx.symbols.create("recurseForDerivations")),
+	typeSymbol(state->ctx.symbols.create("_type"))
+{ }
+
+void JobLister::listAll(nix::Value &root, std::ostream &out)
+{
+	StdVec<AttrPathElem> path;
+	this->listValue(root, path, out);
+}
+
+void JobLister::listAttr(nix::Value &root, StdStr name, std::ostream &out)
+{
+	StdVec<AttrPathElem> path{AttrPathElem{.name = name}};
+
+	nix::Attr const *attr = root.attrs->get(this->state->ctx.symbols.create(name));
+	if (attr == nullptr) {
+		this->printFailure("xil worker has no such attribute", path, out);
+		return;
+	}
+
+	this->listValue(*attr->value, path, out);
+}
+
+void JobLister::listValue(nix::Value &value, StdVec<AttrPathElem> &path, std::ostream &out)
+{
+	nix::checkInterrupt();
+
+	try {
+		if (value.isThunk()) {
+			// Forcing can take arbitrarily long, so make sure whoever's reading has what we have so far.
+			aboutToBlock(out);
+		}
+		this->state->forceValue(value, nix::noPos);
+		if (value.type() != nix::nAttrs) {
+			return;
+		}
+
+		if (this->state->isDerivation(value)) {
+			this->printJob(value, path, out);
+			return;
+		}
+
+		// The top level is always walked, but anything below it has to ask.
+		if (!path.empty()) {
+			nix::Attr const *recurse = value.attrs->get(this->recurseSymbol);
+			if (recurse == nullptr) {
+				return;
+			}
+			this->state->forceValue(*recurse->value, nix::noPos);
+			if (recurse->value->type() != nix::nBool || !recurse->value->boolean) {
+				return;
+			}
+
+			// FIXME: hardcodes pkgs recursion, like Printer does.
+			nix::Attr const *typeAttr = value.attrs->get(this->typeSymbol);
+			if (typeAttr != nullptr && typeAttr->value->type() == nix::nString && typeAttr->value->str() == "pkgs"s) {
+				return;
+			}
+		}
+	} catch (nix::Error &ex) {
+		this->printFailure(ex.msg(), path, out);
+		return;
+	}
+
+	for (auto const &[name, attrValue] : AttrIterable(value.attrs, this->state->ctx.symbols)) {
+		path.push_back(AttrPathElem{.name = name});
+		this->listValue(attrValue, path, out);
+		path.pop_back();
+	}
+}
+
+/** The `"attr":…,"attrPath":[…]` every line starts with. */
+static void printAttrFields(StdVec<AttrPathElem> const &path, std::ostream &out)
+{
+	out << "{\"attr\":";
+	printJsonString(out, renderAttrPath(path));
+	out << ",\"attrPath\":[";
+	for (size_t i = 0; i < path.size(); ++i) {
+		if (i > 0) {
+			out << ",";
+		}
+		printJsonString(out, path[i].name);
+	}
+	out << "]";
+}
+
+void JobLister::printJob(nix::Value &drv, StdVec<AttrPathElem> const &path, std::ostream &out)
+{
+	nix::EvalState &state = *this->state;
+
+	// Get everything that might fail before printing any of it,
+	// so a failure doesn't leave half a line behind.
+	nix::DrvInfo drvInfo{""s, drv.attrs};
+	// This is what actually instantiates the derivation.
+	nix::StorePath const drvPath = drvInfo.requireDrvPath(state);
+	StdString const name = drvInfo.queryName(state);
+	StdString const system = drvInfo.querySystem(state);
+	auto const outputs = drvInfo.queryOutputs(state);
+
+	printAttrFields(path, out);
+	out << ",\"name\":";
+	printJsonString(out, name);
+	out << ",\"system\":";
+	printJsonString(out, system);
+	out << ",\"drvPath\":";
+	printJsonString(out, state.ctx.store->printStorePath(drvPath));
+	out << ",\"outputs\":{";
+	bool first = true;
+	for (auto const &[outputName, outPath] : outputs) {
+		if (!first) {
+			out << ",";
+		}
+		first = false;
+		printJsonString(out, outputName);
+		out << ":";
+		// Content-addressed outputs don't have a path until they're built.
+		if (outPath.has_value()) {
+			printJsonString(out, state.ctx.store->printStorePath(outPath.value()));
+		} else {
+			out << "null";
+		}
+	}
+	out << "}}\n";
+
+	this->jobs += 1;
+}
+
+void JobLister::printFailure(StdStr message, StdVec<AttrPathElem> const &path, std::ostream &out)
+{
+	printAttrFields(path, out);
+	out << ",\"error\":";
+	printJsonString(out, message);
+	out << "}\n";
+
+	this->failures += 1;
+}
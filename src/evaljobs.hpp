@@ -0,0 +1,54 @@
+// `xil eval-jobs`: listing every derivation in an attrset, in the spirit of nix-eval-jobs.
+
+#pragma once
+
+#include <cstddef>
+#include <ostream>
+
+// Lix headers.
+#include <lix/config.h> // IWYU pragma: keep
+// nix::EvalState
+#include <lix/libexpr/eval.hh>
+// nix::Value
+#include <lix/libexpr/value.hh>
+// nix::ref
+#include <lix/libutil/ref.hh>
+
+#include "profile.hpp"
+#include "std/string_view.hpp"
+#include "std/vector.hpp"
+
+/** Walks an attrset the way Hydra does, writing one JSON line for each derivation in it:
+ * `{"attr": …, "attrPath": […], "name": …, "system": …, "drvPath": …, "outputs": {…}}`.
+ * Nested attrsets are only walked into if they have `recurseForDerivations = true`.
+ * Attributes that fail to evaluate get `{"attr": …, "attrPath": […], "error": …}` instead,
+ * and don't stop the rest from being listed.
+ */
+struct JobLister
+{
+	nix::ref<nix::EvalState> state;
+
+	/** How many attributes failed to evaluate so far. */
+	size_t failures = 0;
+
+	/** How many derivations have been listed so far. */
+	size_t jobs = 0;
+
+	nix::Symbol recurseSymbol;
+	nix::Symbol typeSymbol;
+
+	explicit JobLister(nix::ref<nix::EvalState> state);
+
+	/** Lists everything in `root`, which must be a forced attrset. */
+	void listAll(nix::Value &root, std::ostream &out);
+
+	/** Lists everything under `root`'s attribute `name`.
+	 * This is how --jobs splits the work up between workers.
+	 */
+	void listAttr(nix::Value &root, StdStr name, std::ostream &out);
+
+	void listValue(nix::Value &value, StdVec<AttrPathElem> &path, std::ostream &out);
+
+	void printJob(nix::Value &drv, StdVec<AttrPathElem> const &path, std::ostream &out);
+	void printFailure(StdStr message, StdVec<AttrPathElem> const &path, std::ostream &out);
+};
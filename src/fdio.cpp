@@ -0,0 +1,112 @@
+#include "fdio.hpp"
+
+#include <cerrno>
+#include <cstdint>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// Lix headers.
+#include <lix/config.h> // IWYU pragma: keep
+// nix::{Error, SysError}
+#include <lix/libutil/error.hh>
+
+OwnedFd &OwnedFd::operator=(OwnedFd &&other) noexcept
+{
+	if (this != &other) {
+		this->reset(other.release());
+	}
+	return *this;
+}
+
+OwnedFd::~OwnedFd()
+{
+	this->reset();
+}
+
+int OwnedFd::release() noexcept
+{
+	int const fd = this->fd;
+	this->fd = -1;
+	return fd;
+}
+
+void OwnedFd::reset(int newFd) noexcept
+{
+	if (this->fd >= 0) {
+		close(this->fd);
+	}
+	this->fd = newFd;
+}
+
+void setCloseOnExec(int fd)
+{
+	int const flags = fcntl(fd, F_GETFD);
+	if (flags < 0 || fcntl(fd, F_SETFD, flags | FD_CLOEXEC) < 0) {
+		throw nix::SysError("setting close-on-exec on file descriptor %d", fd);
+	}
+}
+
+SigpipeIgnored::SigpipeIgnored()
+{
+	struct sigaction ignore{};
+	ignore.sa_handler = SIG_IGN;
+	sigemptyset(&ignore.sa_mask);
+	sigaction(SIGPIPE, &ignore, &this->previous);
+}
+
+SigpipeIgnored::~SigpipeIgnored()
+{
+	sigaction(SIGPIPE, &this->previous, nullptr);
+}
+
+void writeAll(int fd, void const *data, size_t size, StdStr what)
+{
+	auto const *bytes = static_cast<char const *>(data);
+	while (size > 0) {
+		ssize_t written = write(fd, bytes, size);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw nix::SysError("writing to %s", what);
+		}
+		bytes += written;
+		size -= static_cast<size_t>(written);
+	}
+}
+
+void readAll(int fd, void *data, size_t size, StdStr what)
+{
+	auto *bytes = static_cast<char *>(data);
+	while (size > 0) {
+		ssize_t didRead = read(fd, bytes, size);
+		if (didRead < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw nix::SysError("reading from %s", what);
+		}
+		if (didRead == 0) {
+			throw nix::Error("%s closed unexpectedly", what);
+		}
+		bytes += didRead;
+		size -= static_cast<size_t>(didRead);
+	}
+}
+
+void writeFrame(int fd, StdStr str, StdStr what)
+{
+	auto const size = static_cast<uint32_t>(str.size());
+	writeAll(fd, &size, sizeof(size), what);
+	writeAll(fd, str.data(), str.size(), what);
+}
+
+StdString readFrame(int fd, StdStr what)
+{
+	uint32_t size;
+	readAll(fd, &size, sizeof(size), what);
+	StdString str(size, '\0');
+	readAll(fd, str.data(), size, what);
+	return str;
+}
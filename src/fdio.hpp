@@ -0,0 +1,59 @@
+// Small helpers for talking over pipes and sockets.
+
+#pragma once
+
+#include <cstddef>
+
+#include <signal.h>
+
+#include "std/string.hpp"
+#include "std/string_view.hpp"
+
+/** Closes a file descriptor when it goes out of scope. */
+struct OwnedFd
+{
+	int fd = -1;
+
+	explicit OwnedFd(int fd = -1) : fd(fd) { }
+	OwnedFd(OwnedFd const &) = delete;
+	OwnedFd &operator=(OwnedFd const &) = delete;
+
+	OwnedFd(OwnedFd &&other) noexcept : fd(other.release()) { }
+	OwnedFd &operator=(OwnedFd &&other) noexcept;
+
+	~OwnedFd();
+
+	/** Gives up ownership without closing it. */
+	int release() noexcept;
+
+	void reset(int newFd = -1) noexcept;
+};
+
+/** Sets FD_CLOEXEC on `fd`, for platforms without SOCK_CLOEXEC and friends. */
+void setCloseOnExec(int fd);
+
+/** Ignores SIGPIPE for as long as it's in scope, so writing to a closed pipe or socket fails with EPIPE instead.
+ * Puts back whatever was there before when it goes out of scope, so these should nest.
+ */
+struct SigpipeIgnored
+{
+	SigpipeIgnored();
+	SigpipeIgnored(SigpipeIgnored const &) = delete;
+	SigpipeIgnored &operator=(SigpipeIgnored const &) = delete;
+	~SigpipeIgnored();
+
+private:
+	struct sigaction previous{};
+};
+
+/** Writes all of `data`, retrying on EINTR and short writes. `what` is for error messages. */
+void writeAll(int fd, void const *data, size_t size, StdStr what);
+
+/** Reads exactly `size` bytes, throwing if the other end closes first. `what` is for error messages. */
+void readAll(int fd, void *data, size_t size, StdStr what);
+
+/** Writes `str` with a 32-bit length prefix. */
+void writeFrame(int fd, StdStr str, StdStr what);
+
+/** Reads something written with `writeFrame()`. */
+StdString readFrame(int fd, StdStr what);
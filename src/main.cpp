@@ -1,9 +1,16 @@
 // vim: tabstop=4 shiftwidth=4 noexpandtab
 
 #include <cassert>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <memory>
 #include <ranges>
+#include <sstream>
+
+#include <unistd.h>
 
 // Lix headers.
 #include <lix/config.h> // IWYU pragma: keep
@@ -20,6 +27,7 @@
 #include <lix/libexpr/search-path.hh>
 #include <lix/libexpr/value.hh>
 #include <lix/libmain/shared.hh>
+#include <lix/libstore/globals.hh>
 #include <lix/libstore/outputs-spec.hh>
 #include <lix/libstore/path.hh>
 #include <lix/libutil/async.hh>
@@ -42,6 +50,10 @@
 #include "attriter.hpp"
 #include "xil.hpp"
 #include "build.hpp"
+#include "callpackage.hpp"
+#include "daemon.hpp"
+#include "evaljobs.hpp"
+#include "output.hpp"
 #include "settings.hpp"
 
 using fmt::print, fmt::println;
@@ -50,17 +62,6 @@ using argparse::ArgumentParser;
 //ArgValue<std::string> nullify;
 //ArgValue<std::string>::ValueT nullify_2;
 
-nix::Value callPackage(nix::EvalState &state, nix::Value &targetValue)
-{
-	auto rootPath = nix::CanonPath::fromCwd();
-
-	// Use the user-specified expression for "call package".
-	nix::Expr &callPackageExpr = state.ctx.parseExprFromString(CALLPACKAGE_FUN, rootPath);
-	nix::Value callPackage = nixEval(state, callPackageExpr);
-
-	return nixCallFunction(state, callPackage, targetValue);
-}
-
 nix::InstallableFlake parseInstallable(
 	nix::ref<nix::eval_cache::CachingEvaluator> state,
 	StdString const &installableSpec,
@@ -109,6 +110,22 @@ nix::InstallableFlake parseInstallable(
 }
 
 
+void addWorkerArguments(ArgumentParser &parser)
+{
+	parser.add_argument("--jobs", "-j")
+		.nargs(1)
+		.metavar("N")
+		.default_value(size_t{1})
+		.scan<'u', size_t>()
+		.help("Evaluate the attributes of a top-level attrset in N worker processes at once");
+	parser.add_argument("--worker-heap-limit")
+		.nargs(1)
+		.metavar("MIB")
+		.default_value(size_t{4096})
+		.scan<'u', size_t>()
+		.help("With --jobs, replace a worker with a fresh one once its heap grows past MIB mebibytes");
+}
+
 // FIXME: refactor
 void addEvalArguments(ArgumentParser &parser, bool isPrint)
 {
@@ -130,9 +147,82 @@ void addEvalArguments(ArgumentParser &parser, bool isPrint)
 		.default_value(isPrint ? "auto" : "always")
 		.nargs(1)
 		.help("Print derivations as their drvPaths instead of as attrsets, or only at top-level for auto");
+	parser.add_argument("--cheap-derivations")
+		.flag()
+		.help("Print short derivations by name instead of drvPath, which doesn't need instantiating them");
+	parser.add_argument("--pure-read")
+		.flag()
+		.help("Don't write anything to the store while evaluating; store paths are computed but not created");
+	parser.add_argument("--no-force")
+		.flag()
+		.help("Only show what's already been evaluated, printing everything else as «thunk»; same as --force-depth 0");
+	parser.add_argument("--force-depth")
+		.nargs(1)
+		.metavar("N")
+		.scan<'u', uint32_t>()
+		.help("Only evaluate values nested up to N attrsets and lists deep, printing anything deeper as «thunk»");
+	parser.add_argument("--dedup")
+		.flag()
+		.help("Print attrsets and lists identical to one already printed as «same as PATH», or {\"$same\":[…]} for JSON; buffers all output until done");
+	parser.add_argument("--repeated")
+		.choices("path", "global")
+		.default_value("path")
+		.nargs(1)
+		.help("Print attrsets as «repeated» only when they contain themselves (path), or whenever they've been printed before (global)");
+	parser.add_argument("--eval-cache")
+		.flag()
+		.help("Print a --flake target through the flake eval cache, so printing it again doesn't evaluate anything "
+			"(attrsets are printed in name order, and not checked for repeats)");
+	parser.add_argument("--view")
+		.choices("cleanup", "by-name")
+		.nargs(argparse::nargs_pattern::at_least_one)
+		.help("Show derivations printed in full without drvAttrs, empty lists, or most of meta (cleanup), "
+			"and/or lists of derivations keyed by each one's pname or name (by-name)");
+	parser.add_argument("--format")
+		.choices("nix", "json", "ndjson")
+		.default_value("nix")
+		.nargs(1)
+		.help("Output syntax; ndjson prints one record per top-level attribute as soon as it's evaluated");
+	parser.add_argument("--max-depth")
+		.nargs(1)
+		.metavar("N")
+		.default_value(uint32_t{10})
+		.scan<'u', uint32_t>()
+		.help("Elide attrsets and lists nested more than N deep, without evaluating them");
+	parser.add_argument("--max-attrs-per-set")
+		.nargs(1)
+		.metavar("N")
+		.scan<'u', size_t>()
+		.help("Elide all but the first N attributes of each attrset, without evaluating them");
+	parser.add_argument("--max-list-items")
+		.nargs(1)
+		.metavar("N")
+		.scan<'u', size_t>()
+		.help("Elide all but the first N items of each list, without evaluating them");
+	parser.add_argument("--max-bytes")
+		.nargs(1)
+		.metavar("N")
+		.scan<'u', size_t>()
+		.help("Stop evaluating and elide everything else once N bytes have been printed");
+	parser.add_argument("--attr-timeout")
+		.nargs(1)
+		.metavar("SECONDS")
+		.scan<'g', double>()
+		.help("Give up on forcing any single value after SECONDS, and print «timed out» in its place");
+	parser.add_argument("--profile")
+		.flag()
+		.help("Print the attribute paths that took the longest to evaluate to stderr when done");
+	parser.add_argument("--profile-folded")
+		.nargs(1)
+		.metavar("FILE")
+		.help("Write evaluation time per attribute path to FILE as folded stacks, for flamegraph tools");
+	parser.add_argument("--stats")
+		.flag()
+		.help("Print counts of errors caught while printing to stderr when done");
+	addWorkerArguments(parser);
 }
 
-void addExprArguments(ArgumentParser &parser)
+void addExprArguments(ArgumentParser &parser, bool batchable = false)
 {
 	auto &group = parser.add_mutually_exclusive_group(/* required = */ true);
 
@@ -148,10 +238,25 @@ void addExprArguments(ArgumentParser &parser)
 		.nargs(1)
 		.metavar("FLAKEREF")
 		.help("Evaluate a flake");
+	if (batchable) {
+		group.add_argument("--batch")
+			.nargs(argparse::nargs_pattern::optional)
+			.implicit_value(StdString{"-"})
+			.metavar("FILE")
+			.help("Evaluate and print each line of FILE (or stdin) in turn, sharing one evaluator between all of them");
+		parser.add_argument("--batch-kind")
+			.choices("expr", "flake")
+			.default_value("expr")
+			.nargs(1)
+			.help("Whether --batch lines are Nix expressions or flake references");
+	}
 
 	parser.add_argument("--call-package", "-C")
 		.flag()
-		.help(fmt::format("Use `{}` to call the target expression", CALLPACKAGE_FUN));
+		.help(StdStr{CALLPACKAGE_FUN}.empty()
+			? fmt::format("Call the target function like callPackage, with arguments from `{}`", CALLPACKAGE_PKGS)
+			: fmt::format("Use `{}` to call the target expression", CALLPACKAGE_FUN)
+		);
 
 	parser.add_argument("--installable-mode")
 		.nargs(1)
@@ -160,6 +265,92 @@ void addExprArguments(ArgumentParser &parser)
 		.help("Sets the default attribute prefixes for flake installable fragments");
 }
 
+/** Parses and evaluates a Nix expression given as a string, relative to the current directory. */
+nix::Value evalExprString(nix::EvalState &state, StdString const &exprStr)
+{
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+	nix::Value outValue;
+#pragma clang diagnostic pop
+
+	nix::Expr &expr = state.ctx.parseExprFromString(exprStr, nix::CanonPath::fromCwd());
+	state.eval(expr, outValue);
+
+	return outValue;
+}
+
+/** Finds the eval cache cursor for what a flake reference, and its installable fragment if any, refers to,
+ * without evaluating it.
+ */
+std::shared_ptr<nix::eval_cache::AttrCursor> findFlakeInstallable(
+	nix::EvalState &state,
+	nix::ref<nix::eval_cache::CachingEvaluator> evaluator,
+	StdString const &flakeSpec,
+	InstallableMode installableMode
+)
+{
+	// If we have a flake, then we'll be getting a Value directly, not a nix::Expr.
+	nix::InstallableFlake instFlake = parseInstallable(
+		evaluator,
+		flakeSpec,
+		installableMode
+	);
+
+	using nix::flake::LockedFlake;
+	using nix::flake::LockFlags;
+
+	// First we need to lock the flake, or Nix will complain.
+	auto const lockedFlake = std::make_shared<LockedFlake>(
+		// FIXME: CLI does not allow changing lock flags.
+		nix::flake::lockFlake(state, instFlake.flakeRef, LockFlags{})
+	);
+
+	// We also can only do most things through the eval cache, so let's open that.
+	auto evalCache = nix::openEvalCache(*evaluator, lockedFlake);
+	auto const rootCursor = evalCache->getRoot();
+
+	// Now let's work on the installable fragment part.
+	// For each possible attrpath the fragment could refer to, in order, we'll check if it actually exists,
+	// and use the first one that does.
+	// This goes through eval cache cursors rather than values, so for a flake that's been evaluated before,
+	// finding out which candidates exist is answered from the cache, and only the one we use gets evaluated.
+	StdVec<StdString> const requestedAttrPaths = instFlake.getActualAttrPaths();
+	for (StdString const &requestedPath : requestedAttrPaths) {
+		// An empty path (no fragment) is the flake itself.
+		std::shared_ptr<nix::eval_cache::AttrCursor> cursor = rootCursor.get_ptr();
+		for (StdString const &part : nix::parseAttrPath(requestedPath)) {
+			cursor = cursor->maybeGetAttr(state, state.ctx.symbols.create(part));
+			if (cursor == nullptr) {
+				break;
+			}
+		}
+
+		if (cursor != nullptr) {
+			return cursor;
+		}
+	}
+
+	auto msg = fmt::format(
+		"flake '{}' does not provide any of {}",
+		instFlake.what(),
+		fmt::join(requestedAttrPaths, ", ")
+	);
+	state.ctx.errors.make<nix::EvalError>(msg).debugThrow();
+}
+
+/** Gets the value a flake reference, and its installable fragment if any, refers to. */
+nix::Value evalFlakeInstallable(
+	nix::EvalState &state,
+	nix::ref<nix::eval_cache::CachingEvaluator> evaluator,
+	StdString const &flakeSpec,
+	InstallableMode installableMode
+)
+{
+	auto const cursor = findFlakeInstallable(state, evaluator, flakeSpec, installableMode);
+	// Only the candidate we actually use gets evaluated.
+	return cursor->forceValue(state);
+}
+
 /** Base class for arguments that evaluate Nix expressions in some way. */
 struct XilEvaluatorArgs
 {
@@ -184,9 +375,7 @@ struct XilEvaluatorArgs
 		nix::EvalState &state = *statePtr;
 
 		if (auto const &exprStr = this->evalParser.present("--expr")) {
-			StdString const &str = exprStr.value();
-			nix::Expr &expr = state.ctx.parseExprFromString(str, nix::CanonPath::fromCwd());
-			state.eval(expr, outValue);
+			outValue = evalExprString(state, exprStr.value());
 
 		} else if (auto const &exprFile = this->evalParser.present("--file")) {
 			auto const canonExprFilePath = nix::CanonPath(exprFile.value(), nix::CanonPath::fromCwd());
@@ -195,74 +384,7 @@ struct XilEvaluatorArgs
 			state.eval(expr, outValue);
 
 		} else if (auto const &flakeSpec = this->evalParser.present("--flake")) {
-
-			// If we have a flake, then we'll be getting a Value directly, not a nix::Expr.
-			nix::InstallableFlake instFlake = parseInstallable(
-				evaluator,
-				flakeSpec.value(),
-				installableMode
-			);
-
-			using nix::flake::LockedFlake;
-			using nix::flake::LockFlags;
-
-			// First we need to lock the flake, or Nix will complain.
-			auto const lockedFlake = std::make_shared<LockedFlake>(
-				// FIXME: CLI does not allow changing lock flags.
-				nix::flake::lockFlake(state, instFlake.flakeRef, LockFlags{})
-			);
-
-			// We also can only do most things through the eval cache, so let's open that.
-			auto evalCache = nix::openEvalCache(*evaluator, lockedFlake);
-			auto attrCursor = evalCache->getRoot();
-			auto asValue = attrCursor->forceValue(state);
-
-			// Now let's work on the installable fragment part.
-			// For each possible attrpath the fragment could refer to,
-			// we'll check if it actually exists, and use it if it does.
-			bool found = false;
-			StdVec<StdString> const requestedAttrPaths = instFlake.getActualAttrPaths();
-			for (StdString const &requestedPath : requestedAttrPaths) {
-
-				// This is a bit of a hack.
-				if (requestedPath.empty()) {
-					found = true;
-					outValue = asValue;
-					break;
-				}
-
-				// Get the requested attr path from the installable fragment as Symbols,
-				// and then convert them to string_views.
-				//auto const symToSv = [&](nix::Symbol const &sym) {
-				//	return static_cast<StdStr>(state.ctx.symbols[sym]);
-				//};
-				StdVec<StdString> parsedAttrPath = nix::parseAttrPath(requestedPath);
-				auto needle = parsedAttrPath
-					| std::views::transform([](StdString const &s) -> StdStr {
-						return StdStr{s};
-					})
-					| std::ranges::to<std::vector>();
-				//auto const range = std::ranges::transform_view(parsedAttrPath, symToSv);
-				//StdVec<StdStr> attrPathParts{range.begin(), range.end()};
-
-				assert(asValue.type() == nix::nAttrs);
-
-				AttrIterable currentAttrs{asValue.attrs, state.ctx.symbols};
-				OptionalRef<nix::Attr> result = currentAttrs.find_by_nested_key(state, needle);
-				if (result.has_value()) {
-					found = true;
-					outValue = *result->get().value;
-				}
-			}
-
-			if (!found) {
-				auto msg = fmt::format(
-					"flake '{}' does not provide any of {}",
-					instFlake.what(),
-					fmt::join(requestedAttrPaths, ", ")
-				);
-				state.ctx.errors.make<nix::EvalError>(msg).debugThrow();
-			}
+			outValue = evalFlakeInstallable(state, evaluator, flakeSpec.value(), installableMode);
 		} else {
 			assert("unreachable" == nullptr);
 		}
@@ -302,32 +424,94 @@ struct XilPrinterArgs : public XilEvaluatorArgs
 	{
 		return this->evalParser.get<bool>("--short-errors") || this->isPrint();
 	}
+
+	/** Where to read --batch lines from, if --batch was used. "-" means stdin. */
+	[[nodiscard]]
+	OptString batchSource() const
+	{
+		// Only eval and print have --batch.
+		if (&this->evalParser != &this->evalCmd && &this->evalParser != &this->printCmd) {
+			return std::nullopt;
+		}
+		return this->evalParser.present("--batch");
+	}
+
+	/** Whether the target can be printed through the flake eval cache, rather than as a nix::Value.
+	 * Leaves printed that way are stored in the eval cache, and read back from it next time,
+	 * so printing the same thing from the same locked flake again doesn't evaluate anything.
+	 * It prints differently enough (attribute order, no `seen` check) that it's only used with --eval-cache,
+	 * and options that need to see nix::Values themselves (sharding, deadlines, profiling, and so on) turn it off.
+	 */
+	[[nodiscard]]
+	bool printsFromEvalCache() const
+	{
+		if (&this->evalParser != &this->evalCmd && &this->evalParser != &this->printCmd) {
+			return false;
+		}
+		if (!this->evalParser.get<bool>("--eval-cache")) {
+			return false;
+		}
+		if (!this->evalParser.present("--flake").has_value() || this->batchSource().has_value()) {
+			return false;
+		}
+
+		return !this->evalParser.get<bool>("--call-package")
+			&& this->evalParser.get<StdString>("--repeated") != "global"
+			&& this->evalParser.get<StdString>("--format") != "ndjson"
+			&& this->evalParser.get<size_t>("--jobs") == 1
+			&& !this->evalParser.get<bool>("--dedup")
+			&& !this->evalParser.present<StdVec<StdString>>("--view").has_value()
+			&& !this->evalParser.get<bool>("--no-force")
+			&& !this->evalParser.present("--force-depth").has_value()
+			&& !this->evalParser.present("--attr-timeout").has_value()
+			&& !this->evalParser.get<bool>("--profile")
+			&& !this->evalParser.present("--profile-folded").has_value();
+	}
 };
 
 struct XilArgs
 {
+	// Exactly what we were run with, for starting workers the same way.
+	StdVec<StdString> argv;
+
 	ArgumentParser parser;
 
 	ArgumentParser evalCmd;
 	ArgumentParser printCmd;
 	ArgumentParser posCmd;
 	ArgumentParser buildCmd;
-
-	XilArgs(int argc, char *argv[]) :
-		parser(ArgumentParser{"xil"}),
-		evalCmd(ArgumentParser{"eval"}),
-		printCmd(ArgumentParser{"print"}),
-		posCmd(ArgumentParser{"pos"}),
-		buildCmd(ArgumentParser{"build"})
+	ArgumentParser evalJobsCmd;
+	ArgumentParser daemonCmd;
+
+	/** Whether --help or --version was printed instead of there being a command to run.
+	 * Only ever set without `exitOnHelp`, since otherwise printing them exits.
+	 */
+	bool printedHelp = false;
+
+	/** `exitOnHelp` is whether --help and --version exit the process, which a daemon can't have. */
+	XilArgs(int argc, char *argv[], bool exitOnHelp = true) :
+		argv(argv, argv + argc),
+		parser(ArgumentParser{"xil", "1.0", argparse::default_arguments::all, exitOnHelp}),
+		evalCmd(ArgumentParser{"eval", "1.0", argparse::default_arguments::all, exitOnHelp}),
+		printCmd(ArgumentParser{"print", "1.0", argparse::default_arguments::all, exitOnHelp}),
+		posCmd(ArgumentParser{"pos", "1.0", argparse::default_arguments::all, exitOnHelp}),
+		buildCmd(ArgumentParser{"build", "1.0", argparse::default_arguments::all, exitOnHelp}),
+		evalJobsCmd(ArgumentParser{"eval-jobs", "1.0", argparse::default_arguments::all, exitOnHelp}),
+		daemonCmd(ArgumentParser{"daemon", "1.0", argparse::default_arguments::all, exitOnHelp})
 	{
+		this->parser.add_argument("--connect")
+			.nargs(1)
+			.metavar("SOCKET")
+			.help("Have the `xil daemon` listening on SOCKET run this command (also settable with $XIL_DAEMON_SOCKET)");
+
 		this->parser.add_subparser(this->evalCmd);
 		this->evalCmd.add_description("Evaluate a Nix expression and print what it evaluates to");
-		addExprArguments(this->evalCmd);
+		addExprArguments(this->evalCmd, /* batchable = */ true);
 		addEvalArguments(this->evalCmd, false);
 
 		this->parser.add_subparser(this->printCmd);
 		this->printCmd.add_description("Alias for eval --safe --short-errors --short-derivations=auto");
-		addExprArguments(this->printCmd);
+		addExprArguments(this->printCmd, /* batchable = */ true);
 		addEvalArguments(this->printCmd, true);
 
 		this->parser.add_subparser(this->posCmd);
@@ -339,8 +523,69 @@ struct XilArgs
 		this->parser.add_subparser(this->buildCmd);
 		this->buildCmd.add_description("Build the derivation evaluated from a Nix expression");
 		addExprArguments(this->buildCmd);
+		this->buildCmd.add_argument("--no-plan")
+			.flag()
+			.help("Start building right away, without reading every derivation to be built to list them first");
+
+		this->parser.add_subparser(this->evalJobsCmd);
+		this->evalJobsCmd.add_description(
+			"Instantiate every derivation in an attrset, Hydra-style, printing one JSON line for each"
+		);
+		addExprArguments(this->evalJobsCmd);
+		addWorkerArguments(this->evalJobsCmd);
+
+		this->parser.add_subparser(this->daemonCmd);
+		this->daemonCmd.add_description(
+			"Keep an evaluator warm and run other xil commands for clients that pass --connect"
+		);
+		this->daemonCmd.add_argument("--socket")
+			.nargs(1)
+			.metavar("SOCKET")
+			.default_value(defaultDaemonSocketPath())
+			.help("Unix socket to listen on");
+		this->daemonCmd.add_argument("--keep-evaluator")
+			.flag()
+			.help("Share one evaluator between all clients, so nothing's evaluated twice, "
+				"but files edited after they were first read are still read as they were");
+
+		try {
+			this->parser.parse_args(argc, argv);
+		} catch (std::exception &) {
+			// Without exiting, argparse carries on after printing help,
+			// and then complains about the arguments --help was given instead of.
+			if (exitOnHelp || !this->helpWasUsed()) {
+				throw;
+			}
+		}
+		this->printedHelp = !exitOnHelp && this->helpWasUsed();
+	}
 
-		this->parser.parse_args(argc, argv);
+	[[nodiscard]]
+	bool helpWasUsed() const
+	{
+		for (ArgumentParser const *command : { &this->parser, &this->evalCmd, &this->printCmd, &this->posCmd, &this->buildCmd, &this->evalJobsCmd, &this->daemonCmd }) {
+			if (command->is_used("--help") || command->is_used("--version")) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/** Gets the socket of the daemon we should have run this command, if any. */
+	[[nodiscard]]
+	OptString daemonSocketToConnect() const
+	{
+		// Workers are already run by whoever would have connected.
+		if (this->parser.is_subcommand_used(this->daemonCmd) || isWorkerProcess()) {
+			return std::nullopt;
+		}
+		if (auto const connect = this->parser.present("--connect")) {
+			return connect;
+		}
+		if (char const *fromEnv = std::getenv("XIL_DAEMON_SOCKET")) {
+			return StdString{fromEnv};
+		}
+		return std::nullopt;
 	}
 
 	/** Gets the XilArgs, if any, for `eval` or `print`, whichever is used. */
@@ -382,6 +627,11 @@ struct XilArgs
 				this->parser, // root
 				this->buildCmd // evalParsr
 			};
+		} else if (this->parser.is_subcommand_used(this->evalJobsCmd)) {
+			return XilEvaluatorArgs{
+				this->parser, // root
+				this->evalJobsCmd // evalParser
+			};
 		}
 
 		return std::nullopt;
@@ -456,33 +706,98 @@ auto openCachingEvaluatorOrDie(nix::AsyncIoRoot &aio, nix::ref<nix::Store> store
 	return nix::ref<nix::eval_cache::CachingEvaluator>::unsafeFromPtr(nullable);
 }
 
-int main(int argc, char *argv[])
+/** Keeps evaluation from writing to the store, like `nix eval --read-only`, until destroyed.
+ * It's a global setting, so this puts it back how it was, for the daemon's sake.
+ */
+struct ScopedReadOnlyMode
 {
-	XilArgs args(argc, argv);
+	bool previous;
 
-	nix::initLibStore();
-	nix::initLibExpr();
-	nix::initNix();
+	ScopedReadOnlyMode() : previous(nix::settings.readOnlyMode)
+	{
+		nix::settings.readOnlyMode = true;
+	}
 
-	nix::initPlugins();
+	ScopedReadOnlyMode(ScopedReadOnlyMode const &) = delete;
+	ScopedReadOnlyMode &operator=(ScopedReadOnlyMode const &) = delete;
 
-	//nix::EvalSettings &settings = nix::evalSettings;
-	// FIXME: log IFDs, rather than disallowing them.
-	//assert(settings.set("allow-import-from-derivation", "false"));
+	~ScopedReadOnlyMode()
+	{
+		nix::settings.readOnlyMode = this->previous;
+	}
+};
 
-	nix::AsyncIoRoot aio{};
+/** The things every command needs, which are expensive enough to be worth sharing between commands. */
+struct XilContext
+{
+	nix::AsyncIoRoot &aio;
+	nix::ref<nix::Store> store;
+	nix::ref<nix::eval_cache::CachingEvaluator> evaluator;
+	nix::ref<nix::EvalState> state;
+};
 
-	// FIXME: --store option
-	auto store = aio.blockOn(nix::openStore());
+/** Evaluates and prints each line of `input` as its own expression or flake reference.
+ * Lines that are empty or start with `#` are skipped.
+ * Returns how many lines failed to evaluate or print.
+ */
+size_t printBatch(
+	XilPrinterArgs const &evalArgs,
+	XilContext &ctx,
+	Printer &printer,
+	std::istream &input,
+	std::ostream &out,
+	bool expandDerivations
+)
+{
+	auto const &evalParser = evalArgs.evalParser;
+	bool const isFlake = evalParser.get<StdString>("--batch-kind") == "flake";
+	bool const callPackageItems = evalParser.get<bool>("--call-package");
+
+	size_t failures = 0;
+	StdString line;
+	while (std::getline(input, line)) {
+		if (line.empty() || line.starts_with('#')) {
+			continue;
+		}
 
-	// FIXME: allow specifying SearchPath from command line.
-	auto xilEl = nix::SearchPath::Elem::parse(fmt::format("xil={}", XILLIB_DIR));
-	nix::SearchPath searchPath{std::list<nix::SearchPath::Elem>{xilEl}};
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+		nix::Value itemVal;
+#pragma clang diagnostic pop
 
-	auto evaluator = openCachingEvaluatorOrDie(aio, store);
-	auto state = nix::ref<nix::EvalState>::unsafeFromPtr(evaluator->begin(aio).take());
+		// Anything but an interrupt only fails this item.
+		try {
+			if (isFlake) {
+				itemVal = evalFlakeInstallable(*ctx.state, ctx.evaluator, line, InstallableMode::ALL);
+			} else {
+				itemVal = evalExprString(*ctx.state, line);
+			}
+			if (callPackageItems && isCallPackageTarget(*ctx.state, itemVal)) {
+				itemVal = callPackage(*ctx.state, itemVal);
+			}
+		} catch (nix::Error &e) {
+			printer.printBatchError(line, e.msg(), out);
+			failures += 1;
+			out.flush();
+			continue;
+		}
 
-	//auto state = std::make_shared<nix::EvalState>(searchPath, store, store);
+		if (!printer.printBatchItem(line, itemVal, out, expandDerivations)) {
+			failures += 1;
+		}
+
+		// Whoever's on the other end may well be waiting for this before they send the next line.
+		out.flush();
+	}
+
+	return failures;
+}
+
+int runCommand(XilArgs &args, XilContext &ctx)
+{
+	auto store = ctx.store;
+	auto evaluator = ctx.evaluator;
+	auto state = ctx.state;
 
 	// Handle eval and print commands.
 	if (auto evalArgs_ = args.getPrinterArgs()) {
@@ -495,12 +810,29 @@ int main(int argc, char *argv[])
 		nix::Value rootVal;
 #pragma clang diagnostic pop
 
+		// Set instead of `rootVal` when printing through the eval cache.
+		std::shared_ptr<nix::eval_cache::AttrCursor> rootCursor;
+		bool const fromEvalCache = evalArgs.printsFromEvalCache() && !args.parser.is_subcommand_used(args.posCmd);
+
+		// With --batch, each line gets its own target value instead.
+		auto const batchSource = evalArgs.batchSource();
+
+		// This has to cover evaluating the target, too, since that's where imports get copied to the store.
+		StdOpt<ScopedReadOnlyMode> readOnly;
+		if (evalParser.get<bool>("--pure-read")) {
+			readOnly.emplace();
+		}
+
 		try {
-			rootVal = evalArgs.getTargetValue(state, evaluator);
-			if (evalParser.get<bool>("--call-package") && rootVal.isLambda()) {
-				rootVal = callPackage(*state, rootVal);
+			if (fromEvalCache) {
+				rootCursor = findFlakeInstallable(*state, evaluator, evalParser.get<StdString>("--flake"), InstallableMode::ALL);
+			} else if (!batchSource.has_value()) {
+				rootVal = evalArgs.getTargetValue(state, evaluator);
+				if (evalParser.get<bool>("--call-package") && isCallPackageTarget(*state, rootVal)) {
+					rootVal = callPackage(*state, rootVal);
+				}
 			}
-		} catch (nix::EvalError &e) {
+		} catch (nix::Error &e) {
 			eprintln("{}", e.msg());
 			return 1;
 		}
@@ -510,7 +842,119 @@ int main(int argc, char *argv[])
 		// If it's "auto", then we'll manually check for a top-level derivation attrset.
 		bool const shortDrvs = (shortDrvsOpt == "always") || (shortDrvsOpt == "auto");
 
-		Printer printer(state, evalArgs.safe(), evalArgs.shortErrors(), shortDrvs);
+		auto const format = parseOutputFormat(evalParser.get<StdString>("--format"));
+
+		Printer printer(state, evalArgs.safe(), evalArgs.shortErrors(), shortDrvs, format);
+		printer.cheapDerivations = evalParser.get<bool>("--cheap-derivations");
+		printer.repeatScope = parseRepeatScope(evalParser.get<StdString>("--repeated"));
+		for (StdString const &view : evalParser.present<StdVec<StdString>>("--view").value_or(StdVec<StdString>{})) {
+			if (view == "cleanup") {
+				printer.view.cleanup = true;
+			} else {
+				assert(view == "by-name");
+				printer.view.byName = true;
+			}
+		}
+		if (evalParser.get<bool>("--no-force")) {
+			printer.forceDepth = 0;
+		} else {
+			printer.forceDepth = evalParser.present<uint32_t>("--force-depth");
+		}
+		printer.budget = PrintBudget{
+			.maxDepth = evalParser.get<uint32_t>("--max-depth"),
+			.maxAttrsPerSet = evalParser.present<size_t>("--max-attrs-per-set"),
+			.maxListItems = evalParser.present<size_t>("--max-list-items"),
+			.maxBytes = evalParser.present<size_t>("--max-bytes"),
+		};
+		if (auto const timeout = evalParser.present<double>("--attr-timeout")) {
+			auto const duration = std::chrono::duration<double>(timeout.value());
+			printer.forceDeadline = std::make_unique<ForceDeadline>(
+				std::chrono::duration_cast<ForceDeadline::Clock::duration>(duration)
+			);
+		}
+
+		auto const profileFoldedPath = evalParser.present("--profile-folded");
+		if (evalParser.get<bool>("--profile") || profileFoldedPath.has_value()) {
+			printer.profiler = std::make_unique<EvalProfiler>();
+		}
+
+		auto const jobs = evalParser.get<size_t>("--jobs");
+		auto const workerHeapLimit = evalParser.get<size_t>("--worker-heap-limit") * 1024 * 1024;
+
+		if (isWorkerProcess()) {
+			// We're one of the worker processes for someone else's --jobs,
+			// so everything we print goes back to them, one attribute at a time.
+			if (!printer.shardable(rootVal)) {
+				eprintln("error: xil worker's target value isn't an attrset");
+				return 1;
+			}
+			serveWorkerRequests([&](StdStr name) {
+				return printer.printShard(rootVal, name);
+			}, workerHeapLimit);
+			return 0;
+		}
+		if (evalParser.get<bool>("--dedup")) {
+			printer.dedup = std::make_unique<SubtreeDedup>();
+		}
+
+		if (jobs > 1 && printer.profiler != nullptr) {
+			eprintln("warning: --profile only covers what isn't evaluated in workers with --jobs");
+		}
+
+		// Everything the printer writes goes through this, instead of straight to std::cout.
+		OutputSink sink(STDOUT_FILENO);
+		std::ostream out(&sink);
+
+		// What we print to stderr once all the actual output is done.
+		auto const printReports = [&]() {
+			if (evalParser.get<bool>("--stats")) {
+				printer.printStats();
+			}
+			if (evalParser.get<bool>("--profile")) {
+				// FIXME: make configurable.
+				printer.profiler->printReport(20);
+			}
+			if (profileFoldedPath.has_value()) {
+				std::ofstream foldedFile(profileFoldedPath.value());
+				printer.profiler->writeFolded(foldedFile);
+			}
+		};
+
+		if (batchSource.has_value()) {
+			std::ifstream batchFile;
+			if (batchSource.value() != "-") {
+				batchFile.open(batchSource.value());
+				if (!batchFile) {
+					eprintln("error: couldn't open batch file {}", batchSource.value());
+					return 1;
+				}
+			}
+			std::istream &batchInput = batchFile.is_open() ? batchFile : std::cin;
+
+			size_t failures = 0;
+			try {
+				failures = printBatch(evalArgs, ctx, printer, batchInput, out, shortDrvsOpt == "auto");
+			} catch (nix::Interrupted &e) {
+				sink.flushNow();
+				eprintln("Interrupted: {}\n", e.msg());
+			}
+			sink.flushNow();
+			printReports();
+			return (failures > 0) ? 2 : 0;
+		}
+
+		// With --dedup, everything's printed into memory first, so repeats can be taken back out.
+		StdOpt<std::ostream> dedupOut;
+		if (printer.dedup != nullptr) {
+			dedupOut.emplace(&printer.dedup->buffer);
+		}
+		std::ostream &printOut = dedupOut.has_value() ? dedupOut.value() : out;
+		auto const writeDeduped = [&]() {
+			if (printer.dedup != nullptr) {
+				out << printer.dedup->buffer.view();
+				printer.dedup->buffer.truncate(0);
+			}
+		};
 
 		try {
 			if (args.parser.is_subcommand_used(args.posCmd)) {
@@ -521,21 +965,116 @@ int main(int argc, char *argv[])
 				  // return early to prevent adding a redundant newline
 				  return 0;
 				}
+			} else if (rootCursor != nullptr) {
+				printer.printCursor(rootCursor, printOut, shortDrvsOpt == "auto");
+			} else if (jobs > 1 && printer.shardable(rootVal)) {
+				WorkerPool pool(args.argv, jobs);
+				printer.printSharded(rootVal, printOut, pool);
+			} else if (format == OutputFormat::NDJSON) {
+				printer.printRecords(rootVal, printOut);
 			} else if (state->isDerivation(rootVal) && shortDrvsOpt == "auto") {
 				// If we're printing this derivation "not-short", then run the attr printer manually.
-				printer.printAttrs(rootVal.attrs, std::cout, 0, 0);
+				printer.printAttrs(rootVal.attrs, printOut, 0, 0, printer.derivationFilter());
 			} else {
 				// Otherwise print as normal.
-				printer.printValue(rootVal, std::cout, 0, 0);
+				printer.printValue(rootVal, printOut, 0, 0);
 			}
-			// Add a trailing newline.
-			println("");
+			writeDeduped();
+			// Add a trailing newline. NDJSON records are already newline-terminated.
+			if (format != OutputFormat::NDJSON) {
+				out << "\n";
+			}
+			sink.flushNow();
+
+			printReports();
 		} catch (nix::Interrupted &e) {
+			writeDeduped();
+			sink.flushNow();
 			eprintln("Interrupted: {}\n", e.msg());
-		} catch (nix::EvalError &e) {
+		} catch (nix::Error &e) {
+			writeDeduped();
+			sink.flushNow();
 			eprintln("{}", e.msg());
 			return 2;
 		}
+	} else if (args.parser.is_subcommand_used(args.evalJobsCmd)) {
+		auto evalArgs = args.getEvalArgs().value();
+		auto const &jobsParser = args.evalJobsCmd;
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+		nix::Value rootVal;
+#pragma clang diagnostic pop
+
+		try {
+			rootVal = evalArgs.getTargetValue(state, evaluator);
+			if (jobsParser.get<bool>("--call-package") && isCallPackageTarget(*state, rootVal)) {
+				rootVal = callPackage(*state, rootVal);
+			}
+			state->forceValue(rootVal, nix::noPos);
+		} catch (nix::Error &e) {
+			eprintln("{}", e.msg());
+			return 1;
+		}
+
+		JobLister lister(state);
+
+		auto const jobs = jobsParser.get<size_t>("--jobs");
+		auto const workerHeapLimit = jobsParser.get<size_t>("--worker-heap-limit") * 1024 * 1024;
+
+		if (isWorkerProcess()) {
+			serveWorkerRequests([&](StdStr name) {
+				std::ostringstream workerOut;
+				size_t const failuresBefore = lister.failures;
+				lister.listAttr(rootVal, name, workerOut);
+
+				// How many of these were failures goes in front, so the parent can count them too.
+				size_t const failed = lister.failures - failuresBefore;
+				StdString reply(sizeof(failed), '\0');
+				std::memcpy(reply.data(), &failed, sizeof(failed));
+				reply += workerOut.view();
+				return reply;
+			}, workerHeapLimit);
+			return 0;
+		}
+
+		OutputSink sink(STDOUT_FILENO);
+		std::ostream out(&sink);
+
+		try {
+			if (jobs > 1 && rootVal.type() == nix::nAttrs && !state->isDerivation(rootVal)) {
+				StdVec<StdString> names;
+				for (auto const &[name, value] : AttrIterable(rootVal.attrs, state->ctx.symbols)) {
+					names.emplace_back(name);
+				}
+
+				WorkerPool pool(args.argv, jobs);
+				pool.run(names, [&](size_t index, StdOpt<StdString> reply) {
+					if (reply.has_value()) {
+						size_t failed;
+						std::memcpy(&failed, reply->data(), sizeof(failed));
+						lister.failures += failed;
+						out << StdStr{*reply}.substr(sizeof(failed));
+					} else {
+						StdVec<AttrPathElem> const path{AttrPathElem{.name = names[index]}};
+						lister.printFailure("xil worker died while evaluating this", path, out);
+					}
+					aboutToBlock(out);
+				}, /* inOrder = */ false);
+			} else {
+				lister.listAll(rootVal, out);
+			}
+		} catch (nix::Interrupted &e) {
+			sink.flushNow();
+			eprintln("Interrupted: {}", e.msg());
+			return 1;
+		}
+		sink.flushNow();
+
+		if (lister.failures > 0) {
+			eprintln("{} {} failed to evaluate", lister.failures, maybePluralize(lister.failures, "attribute"));
+			return 1;
+		}
 	} else if (args.parser.is_subcommand_used("build")) {
 		auto evalArgs = args.getEvalArgs().value();
 		try {
@@ -549,6 +1088,7 @@ int main(int argc, char *argv[])
 			assert(state->isDerivation(rootVal));
 
 			DrvBuilder builder(state, store, rootVal);
+			builder.showPlan = !args.buildCmd.get<bool>("--no-plan");
 			eprintln("Expression evaluated to derivation {}", builder.meta.drvPath);
 			builder.realizeDerivations();
 		} catch (nix::Interrupted &ex) {
@@ -561,3 +1101,80 @@ int main(int argc, char *argv[])
 
 	return 0;
 }
+
+int main(int argc, char *argv[])
+{
+	XilArgs args(argc, argv);
+
+	// If there's a daemon with a warm evaluator around, let it do the work.
+	if (auto const socketPath = args.daemonSocketToConnect()) {
+		try {
+			if (auto const exitCode = runViaDaemon(socketPath.value(), argc, argv)) {
+				return exitCode.value();
+			}
+		} catch (nix::Error &ex) {
+			// The daemon might have printed some of the output already, so doing it all again locally would be wrong.
+			eprintln("error: lost xil daemon at {}: {}", socketPath.value(), ex.msg());
+			return 1;
+		}
+		eprintln("warning: evaluating locally instead");
+	}
+
+	nix::initLibStore();
+	nix::initLibExpr();
+	nix::initNix();
+
+	nix::initPlugins();
+
+	//nix::EvalSettings &settings = nix::evalSettings;
+	// FIXME: log IFDs, rather than disallowing them.
+	//assert(settings.set("allow-import-from-derivation", "false"));
+
+	nix::AsyncIoRoot aio{};
+
+	// FIXME: --store option
+	auto store = aio.blockOn(nix::openStore());
+
+	// FIXME: allow specifying SearchPath from command line.
+	auto xilEl = nix::SearchPath::Elem::parse(fmt::format("xil={}", XILLIB_DIR));
+	nix::SearchPath searchPath{std::list<nix::SearchPath::Elem>{xilEl}};
+
+	auto evaluator = openCachingEvaluatorOrDie(aio, store);
+	auto state = nix::ref<nix::EvalState>::unsafeFromPtr(evaluator->begin(aio).take());
+
+	//auto state = std::make_shared<nix::EvalState>(searchPath, store, store);
+
+	XilContext ctx{aio, store, evaluator, state};
+
+	if (args.parser.is_subcommand_used(args.daemonCmd)) {
+		auto const socketPath = args.daemonCmd.get<StdString>("--socket");
+		bool const keepEvaluator = args.daemonCmd.get<bool>("--keep-evaluator");
+		// The store connection, plugins, and the flake eval cache on disk are shared between all clients.
+		// The evaluator only is with --keep-evaluator, since it never rereads a file it's already parsed.
+		return serveDaemon(socketPath, [&](StdVec<StdString> &clientArgv) -> int {
+			// argparse wants a C-style argv.
+			StdVec<char *> cArgv;
+			for (StdString &arg : clientArgv) {
+				cArgv.push_back(arg.data());
+			}
+			cArgv.push_back(nullptr);
+
+			XilArgs clientArgs(static_cast<int>(clientArgv.size()), cArgv.data(), /* exitOnHelp = */ false);
+			if (clientArgs.printedHelp) {
+				return 0;
+			}
+
+			if (keepEvaluator) {
+				return runCommand(clientArgs, ctx);
+			}
+
+			forgetCallPackageArgs();
+			auto clientEvaluator = openCachingEvaluatorOrDie(aio, store);
+			auto clientState = nix::ref<nix::EvalState>::unsafeFromPtr(clientEvaluator->begin(aio).take());
+			XilContext clientCtx{aio, store, clientEvaluator, clientState};
+			return runCommand(clientArgs, clientCtx);
+		});
+	}
+
+	return runCommand(args, ctx);
+}
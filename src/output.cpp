@@ -0,0 +1,208 @@
+#include "output.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Lix headers.
+#include <lix/config.h> // IWYU pragma: keep
+// nix::SysError
+#include <lix/libutil/error.hh>
+
+using namespace std::literals::chrono_literals;
+
+OutputSink::OutputSink(int fd, size_t capacity) :
+	fd(fd),
+	isTty(isatty(fd) == 1),
+	// Humans notice latency way sooner than pipes do.
+	maxLatency(this->isTty ? Clock::duration(50ms) : Clock::duration(1s)),
+	lastFlush(Clock::now()),
+	buffer(capacity)
+{
+	this->setp(this->buffer.data(), this->buffer.data() + this->buffer.size());
+}
+
+OutputSink::~OutputSink()
+{
+	// Destructors can't throw, and if stdout is gone there isn't much left to tell anyone.
+	try {
+		this->flushNow();
+	} catch (...) {
+	}
+}
+
+size_t OutputSink::pending() const noexcept
+{
+	return static_cast<size_t>(this->pptr() - this->pbase());
+}
+
+void OutputSink::writeOut(StdStr extra)
+{
+	iovec iov[2] = {
+		{ .iov_base = this->pbase(), .iov_len = this->pending() },
+		{ .iov_base = const_cast<char *>(extra.data()), .iov_len = extra.size() },
+	};
+	this->flushedBytes += iov[0].iov_len + iov[1].iov_len;
+
+	iovec *current = iov;
+	int remaining = (iov[1].iov_len > 0) ? 2 : 1;
+
+	while (remaining > 0 && (current[0].iov_len > 0 || remaining > 1)) {
+		ssize_t written = writev(this->fd, current, remaining);
+		this->writeCalls += 1;
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw nix::SysError("writing output");
+		}
+
+		// Skip past whatever got fully written, and adjust whatever got partially written.
+		auto advance = static_cast<size_t>(written);
+		while (remaining > 0 && advance >= current->iov_len) {
+			advance -= current->iov_len;
+			++current;
+			--remaining;
+		}
+		if (remaining > 0) {
+			current->iov_base = static_cast<char *>(current->iov_base) + advance;
+			current->iov_len -= advance;
+		}
+	}
+
+	this->setp(this->buffer.data(), this->buffer.data() + this->buffer.size());
+	this->lastFlush = Clock::now();
+}
+
+void OutputSink::flushNow()
+{
+	if (this->pending() == 0) {
+		return;
+	}
+	this->writeOut();
+}
+
+void OutputSink::poll()
+{
+	if (this->pending() == 0) {
+		return;
+	}
+
+	if (Clock::now() - this->lastFlush >= this->maxLatency) {
+		this->flushNow();
+	}
+}
+
+void OutputSink::aboutToBlock()
+{
+	if (this->isTty) {
+		this->flushNow();
+	} else {
+		this->poll();
+	}
+}
+
+OutputSink::int_type OutputSink::overflow(int_type ch)
+{
+	// Buffer is full.
+	this->flushNow();
+	if (traits_type::eq_int_type(ch, traits_type::eof())) {
+		return traits_type::not_eof(ch);
+	}
+
+	*this->pptr() = traits_type::to_char_type(ch);
+	this->pbump(1);
+	return ch;
+}
+
+std::streamsize OutputSink::xsputn(char const *data, std::streamsize count)
+{
+	auto const size = static_cast<size_t>(count);
+	auto const space = static_cast<size_t>(this->epptr() - this->pptr());
+
+	if (size <= space) {
+		std::memcpy(this->pptr(), data, size);
+		// pbump() takes an int, so step in chunks for the (unlikely) case of > 2GiB buffers.
+		for (size_t left = size; left > 0; ) {
+			auto const step = std::min<size_t>(left, INT32_MAX);
+			this->pbump(static_cast<int>(step));
+			left -= step;
+		}
+		return count;
+	}
+
+	// Doesn't fit: send what we have along with this, without copying it into the buffer first.
+	this->writeOut(StdStr{data, size});
+	return count;
+}
+
+int OutputSink::sync()
+{
+	try {
+		this->flushNow();
+	} catch (nix::SysError &) {
+		return -1;
+	}
+	return 0;
+}
+
+OutputSink::pos_type OutputSink::seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which)
+{
+	if (off != 0 || dir != std::ios_base::cur || (which & std::ios_base::out) == 0) {
+		return pos_type(off_type(-1));
+	}
+
+	return pos_type(static_cast<off_type>(this->flushedBytes + this->pending()));
+}
+
+StdStr StringSink::view() const noexcept
+{
+	return this->data;
+}
+
+size_t StringSink::size() const noexcept
+{
+	return this->data.size();
+}
+
+void StringSink::truncate(size_t size)
+{
+	assert(size <= this->data.size());
+	this->data.resize(size);
+}
+
+StringSink::int_type StringSink::overflow(int_type ch)
+{
+	if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+		this->data.push_back(traits_type::to_char_type(ch));
+	}
+	return traits_type::not_eof(ch);
+}
+
+std::streamsize StringSink::xsputn(char const *data, std::streamsize count)
+{
+	this->data.append(data, static_cast<size_t>(count));
+	return count;
+}
+
+StringSink::pos_type StringSink::seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which)
+{
+	if (off != 0 || dir != std::ios_base::cur || (which & std::ios_base::out) == 0) {
+		return pos_type(off_type(-1));
+	}
+
+	return pos_type(static_cast<off_type>(this->data.size()));
+}
+
+void aboutToBlock(std::ostream &out)
+{
+	if (auto *sink = dynamic_cast<OutputSink *>(out.rdbuf())) {
+		sink->aboutToBlock();
+	} else {
+		std::flush(out);
+	}
+}
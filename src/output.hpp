@@ -0,0 +1,109 @@
+// Buffered output for Printer.
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <ostream>
+#include <streambuf>
+
+#include "std/string.hpp"
+#include "std/string_view.hpp"
+#include "std/vector.hpp"
+
+/** A std::streambuf that writes to a file descriptor through one large, reusable buffer.
+ *
+ * Printer writes a lot of very small pieces, and used to std::flush after every attribute,
+ * which meant one write(2) per attribute. This instead only actually writes when:
+ *  - the buffer fills up (writes too big for the buffer are sent along with it in a single writev(2)),
+ *  - buffered output has been sitting around for longer than `maxLatency`, or
+ *  - the caller says it's about to do something that might block for a while (`aboutToBlock()`),
+ *    and we're writing to a terminal, where a human is waiting to see progress.
+ */
+struct OutputSink : public std::streambuf
+{
+	using Clock = std::chrono::steady_clock;
+
+	// Big enough that dumping even huge attrsets to a file or pipe isn't syscall-bound.
+	static constexpr size_t DEFAULT_CAPACITY = 256 * 1024;
+
+	int fd;
+	bool isTty;
+
+	/** How long output may sit in the buffer before the next opportunity to flush takes it. */
+	Clock::duration maxLatency;
+
+	Clock::time_point lastFlush;
+
+	/** Total number of write(2)/writev(2) calls made, for the curious. */
+	size_t writeCalls = 0;
+
+	/** Bytes actually written so far, not counting what's still buffered. */
+	size_t flushedBytes = 0;
+
+	explicit OutputSink(int fd, size_t capacity = DEFAULT_CAPACITY);
+
+	// Not copyable or movable, as std::ostreams will be pointing at us.
+	OutputSink(OutputSink const &) = delete;
+	OutputSink &operator=(OutputSink const &) = delete;
+
+	~OutputSink() override;
+
+	/** Write out everything buffered so far. */
+	void flushNow();
+
+	/** Flush if the byte or time threshold has been hit. Cheap to call often. */
+	void poll();
+
+	/** Call before doing something that might take a long time, like forcing a thunk.
+	 * On a TTY this flushes whatever is pending so the user can see how far we've gotten.
+	 * Otherwise this is the same as `poll()`.
+	 */
+	void aboutToBlock();
+
+	/** Number of bytes currently sitting in the buffer. */
+	[[nodiscard]]
+	size_t pending() const noexcept;
+
+protected:
+	int_type overflow(int_type ch) override;
+	std::streamsize xsputn(char const *data, std::streamsize count) override;
+	int sync() override;
+	// Only supports asking where we are (i.e. std::ostream::tellp()), which is how many bytes have gone through us.
+	pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+
+private:
+	StdVec<char> buffer;
+
+	/** Write the buffer and then `extra`, in a single writev(2) if possible. */
+	void writeOut(StdStr extra = {});
+};
+
+/** A std::streambuf that keeps everything written to it in memory, and can be cut back short again.
+ * For when what's been printed so far might need to be taken back.
+ */
+struct StringSink : public std::streambuf
+{
+	[[nodiscard]]
+	StdStr view() const noexcept;
+
+	[[nodiscard]]
+	size_t size() const noexcept;
+
+	/** Throw away everything past the first `size` bytes. */
+	void truncate(size_t size);
+
+protected:
+	int_type overflow(int_type ch) override;
+	std::streamsize xsputn(char const *data, std::streamsize count) override;
+	// Only supports asking where we are (i.e. std::ostream::tellp()).
+	pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+
+private:
+	StdString data;
+};
+
+/** If `out` is backed by an OutputSink, let it know we're about to (maybe) block.
+ * Otherwise just std::flush it, since we don't know any better.
+ */
+void aboutToBlock(std::ostream &out);
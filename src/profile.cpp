@@ -0,0 +1,136 @@
+#include "profile.hpp"
+
+#include <algorithm>
+#include <sstream>
+
+#include <fmt/format.h>
+
+#include "std/vector.hpp"
+#include "xil.hpp"
+
+// Attr names can be anything, so quote the ones that would be confused for path syntax.
+static void appendPathElem(StdString &out, AttrPathElem const &elem, StdStr separators)
+{
+	if (elem.isListItem()) {
+		fmt::format_to(std::back_inserter(out), "[{}]", elem.listIndex.value());
+		return;
+	}
+
+	bool const needsQuotes = elem.name.empty()
+		|| elem.name.find_first_of(separators) != StdStr::npos
+		|| elem.name.find_first_of(" \t\n\"\\") != StdStr::npos;
+	if (!needsQuotes) {
+		out.append(elem.name);
+		return;
+	}
+
+	// Escaped like a Nix string, so a quote in the name doesn't end it early.
+	out.push_back('"');
+	for (char const c : elem.name) {
+		if (c == '"' || c == '\\') {
+			out.push_back('\\');
+		}
+		out.push_back(c);
+	}
+	out.push_back('"');
+}
+
+StdString renderAttrPath(StdSpan<AttrPathElem const> path)
+{
+	StdString rendered;
+	for (auto const &elem : path) {
+		if (!rendered.empty()) {
+			rendered.push_back('.');
+		}
+		appendPathElem(rendered, elem, ".");
+	}
+	return rendered;
+}
+
+StdString renderJsonAttrPath(StdSpan<AttrPathElem const> path)
+{
+	std::ostringstream rendered;
+	rendered << "[";
+	for (size_t i = 0; i < path.size(); ++i) {
+		if (i > 0) {
+			rendered << ",";
+		}
+		if (path[i].isListItem()) {
+			rendered << path[i].listIndex.value();
+		} else {
+			printJsonString(rendered, path[i].name);
+		}
+	}
+	rendered << "]";
+	return rendered.str();
+}
+
+void EvalProfiler::record(StdSpan<AttrPathElem const> path, ProfileEntry::Duration elapsed)
+{
+	// Every prefix of this path gets this force counted in its total.
+	StdString key;
+	for (size_t i = 0; i <= path.size(); ++i) {
+		if (i > 0) {
+			if (i > 1) {
+				key.push_back(';');
+			}
+			appendPathElem(key, path[i - 1], ";");
+		}
+
+		auto [found, inserted] = this->byPath.try_emplace(key);
+		ProfileEntry &entry = found->second;
+		if (inserted) {
+			entry.displayPath = (i == 0) ? "«root»" : renderAttrPath(path.first(i));
+		}
+		entry.totalTime += elapsed;
+		entry.totalForced += 1;
+		if (i == path.size()) {
+			entry.selfTime += elapsed;
+			entry.selfForced += 1;
+		}
+	}
+}
+
+void EvalProfiler::printReport(size_t limit) const
+{
+	using Entry = decltype(this->byPath)::value_type const *;
+
+	StdVec<Entry> sorted;
+	sorted.reserve(this->byPath.size());
+	for (auto const &entry : this->byPath) {
+		sorted.push_back(&entry);
+	}
+
+	auto const shown = std::min(limit, sorted.size());
+	std::partial_sort(sorted.begin(), sorted.begin() + shown, sorted.end(), [](Entry lhs, Entry rhs) {
+		return lhs->second.totalTime > rhs->second.totalTime;
+	});
+
+	auto seconds = [](ProfileEntry::Duration d) {
+		return std::chrono::duration<double>(d).count();
+	};
+
+	eprintln("most expensive {} of {} attribute paths:", shown, sorted.size());
+	eprintln("    {:>10} {:>10} {:>8}  {}", "total", "self", "forced", "path");
+	for (size_t i = 0; i < shown; ++i) {
+		auto const &stats = sorted[i]->second;
+		eprintln(
+			"    {:>9.3f}s {:>9.3f}s {:>8}  {}",
+			seconds(stats.totalTime),
+			seconds(stats.selfTime),
+			stats.totalForced,
+			stats.displayPath
+		);
+	}
+}
+
+void EvalProfiler::writeFolded(std::ostream &out) const
+{
+	for (auto const &[key, stats] : this->byPath) {
+		if (stats.selfForced == 0) {
+			continue;
+		}
+		auto const micros = std::chrono::duration_cast<std::chrono::microseconds>(stats.selfTime).count();
+		out << (key.empty() ? "«root»" : key) << " " << micros << "\n";
+	}
+}
@@ -0,0 +1,66 @@
+// Per-attribute-path evaluation profiling for Printer.
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <ostream>
+#include <unordered_map>
+
+#include "std/optional.hpp"
+#include "std/span.hpp"
+#include "std/string.hpp"
+#include "std/string_view.hpp"
+
+/** One step of the path from the value being printed to wherever Printer currently is. */
+struct AttrPathElem
+{
+	// Attribute name, unless this is a list item. Attribute names can be empty too.
+	StdStr name = {};
+	// Set for list items only.
+	StdOpt<size_t> listIndex = std::nullopt;
+
+	[[nodiscard]]
+	bool isListItem() const noexcept
+	{
+		return this->listIndex.has_value();
+	}
+};
+
+/** Renders a path like `foo.bar.[2]`, quoting names that would be ambiguous. */
+StdString renderAttrPath(StdSpan<AttrPathElem const> path);
+
+/** Renders a path as a JSON array of attribute names and list indices, like `["foo","bar",2]`. */
+StdString renderJsonAttrPath(StdSpan<AttrPathElem const> path);
+
+/** Time and thunks forced under one attribute path. */
+struct ProfileEntry
+{
+	using Duration = std::chrono::steady_clock::duration;
+
+	// Spent forcing this path's value itself.
+	Duration selfTime{};
+	// Spent forcing this path's value and everything under it.
+	Duration totalTime{};
+	size_t selfForced = 0;
+	size_t totalForced = 0;
+
+	// As renderAttrPath() would show it.
+	StdString displayPath;
+};
+
+/** Collects how long each force Printer does takes, by the attribute path it was done at. */
+struct EvalProfiler
+{
+	// Keyed by path in folded-stack form (`foo;bar;[2]`), which is also how we write them out.
+	std::unordered_map<StdString, ProfileEntry> byPath;
+
+	/** Records one force of the value at `path`. */
+	void record(StdSpan<AttrPathElem const> path, ProfileEntry::Duration elapsed);
+
+	/** Prints the `limit` most expensive paths, by total time, to stderr. */
+	void printReport(size_t limit) const;
+
+	/** Writes self times as folded stacks (`a;b;c microseconds`), for flamegraph.pl and friends. */
+	void writeFolded(std::ostream &out) const;
+};
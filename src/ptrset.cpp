@@ -0,0 +1,106 @@
+#include "ptrset.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <utility>
+
+namespace
+{
+	// Plenty of room for the attrsets on one path, so scoped sets never need to grow.
+	constexpr size_t INITIAL_CAPACITY = 64;
+}
+
+size_t PointerSet::home(void const *ptr) const noexcept
+{
+	// Fibonacci hashing. Allocations are aligned, so the low bits of `ptr` are the least useful ones;
+	// this spreads all of them into the high bits, which we then take.
+	auto const bits = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(ptr)) * UINT64_C(0x9E3779B97F4A7C15);
+	auto const shift = 64 - std::countr_zero(this->slots.size());
+	return static_cast<size_t>(bits >> (shift & 63)) & this->mask();
+}
+
+size_t PointerSet::find(void const *ptr) const noexcept
+{
+	size_t index = this->home(ptr);
+	while (this->slots[index] != nullptr && this->slots[index] != ptr) {
+		index = (index + 1) & this->mask();
+	}
+	return index;
+}
+
+bool PointerSet::insert(void const *ptr)
+{
+	assert(ptr != nullptr);
+
+	// Keep the load factor at or under 1/2, so probe sequences stay short.
+	if ((this->count + 1) * 2 > this->slots.size()) {
+		this->grow();
+	}
+
+	size_t const index = this->find(ptr);
+	if (this->slots[index] != nullptr) {
+		return false;
+	}
+	this->slots[index] = ptr;
+	this->count += 1;
+	return true;
+}
+
+bool PointerSet::erase(void const *ptr)
+{
+	if (this->count == 0) {
+		return false;
+	}
+
+	size_t hole = this->find(ptr);
+	if (this->slots[hole] == nullptr) {
+		return false;
+	}
+	this->slots[hole] = nullptr;
+	this->count -= 1;
+
+	// Shift back anything after the hole that would no longer be findable past it.
+	for (size_t next = (hole + 1) & this->mask(); this->slots[next] != nullptr; next = (next + 1) & this->mask()) {
+		size_t const wanted = this->home(this->slots[next]);
+		// Whether `wanted` is cyclically in (hole, next]. If so it can stay where it is.
+		bool const reachable = (hole <= next)
+			? (hole < wanted && wanted <= next)
+			: (hole < wanted || wanted <= next);
+		if (!reachable) {
+			this->slots[hole] = std::exchange(this->slots[next], nullptr);
+			hole = next;
+		}
+	}
+
+	return true;
+}
+
+bool PointerSet::contains(void const *ptr) const noexcept
+{
+	if (this->count == 0) {
+		return false;
+	}
+	return this->slots[this->find(ptr)] != nullptr;
+}
+
+void PointerSet::clear() noexcept
+{
+	if (this->count == 0) {
+		return;
+	}
+	std::fill(this->slots.begin(), this->slots.end(), nullptr);
+	this->count = 0;
+}
+
+void PointerSet::grow()
+{
+	StdVec<void const *> old(this->slots.empty() ? INITIAL_CAPACITY : this->slots.size() * 2, nullptr);
+	std::swap(old, this->slots);
+
+	for (void const *ptr : old) {
+		if (ptr != nullptr) {
+			this->slots[this->find(ptr)] = ptr;
+		}
+	}
+}
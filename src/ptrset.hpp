@@ -0,0 +1,59 @@
+// A flat hash set of pointers, for Printer's cycle detection.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "std/vector.hpp"
+
+/** A set of non-null pointers, stored in one flat array with open addressing and linear probing.
+ *
+ * Printer checks every attrset it prints against this, so unlike std::set there's no allocation per entry
+ * and no pointer chasing per lookup. Erasing uses backward-shift deletion rather than tombstones,
+ * so a set that's constantly inserted into and erased from (like one tracking the current path) stays fast,
+ * and never grows past what it's had in it at once.
+ */
+struct PointerSet
+{
+	PointerSet() = default;
+
+	/** Returns false if `ptr` was already in the set. */
+	bool insert(void const *ptr);
+
+	/** Returns false if `ptr` wasn't in the set. */
+	bool erase(void const *ptr);
+
+	[[nodiscard]]
+	bool contains(void const *ptr) const noexcept;
+
+	/** Empties the set, but keeps its memory for reuse. */
+	void clear() noexcept;
+
+	[[nodiscard]]
+	size_t size() const noexcept
+	{
+		return this->count;
+	}
+
+private:
+	// Empty slots are nullptr. Always a power of two in size, or empty.
+	StdVec<void const *> slots;
+	size_t count = 0;
+
+	[[nodiscard]]
+	size_t mask() const noexcept
+	{
+		return this->slots.size() - 1;
+	}
+
+	/** Where `ptr` would ideally go. */
+	[[nodiscard]]
+	size_t home(void const *ptr) const noexcept;
+
+	/** Index of `ptr`'s slot, or of the empty slot where it would go. `slots` must not be empty. */
+	[[nodiscard]]
+	size_t find(void const *ptr) const noexcept;
+
+	void grow();
+};
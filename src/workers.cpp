@@ -0,0 +1,298 @@
+#include "workers.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <map>
+#include <ranges>
+
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if defined(__APPLE__)
+#include <mach-o/dyld.h>
+#endif
+
+#include <gc/gc.h>
+
+#include <fmt/format.h>
+
+// Lix headers.
+#include <lix/config.h> // IWYU pragma: keep
+// nix::{Error, SysError}
+#include <lix/libutil/error.hh>
+// nix::checkInterrupt
+#include <lix/libutil/signals.hh>
+
+namespace stdfs = std::filesystem;
+
+namespace
+{
+	// Set in the environment of worker processes.
+	constexpr char const *WORKER_ENV_VAR = "XIL_WORKER";
+
+	constexpr StdStr WORKER_WHAT = "xil worker pipe";
+
+	// Messages a worker sends after each reply.
+	constexpr char STATUS_READY = 'k';
+	constexpr char STATUS_RETIRING = 'x';
+
+	// How many replies we'll hold onto per worker while waiting for an earlier one to finish.
+	// Keeps one slow request from making us buffer everything after it.
+	constexpr size_t REORDER_WINDOW_PER_WORKER = 16;
+
+	// Tagged so the worker can tell a request from the pool closing its stdin.
+	constexpr char REQUEST_TAG = 'r';
+
+	/** pipe(2), but with both ends close-on-exec, like pipe2(O_CLOEXEC) on platforms that have it. */
+	int pipeCloseOnExec(int (&fds)[2])
+	{
+		if (pipe(fds) < 0) {
+			return -1;
+		}
+		setCloseOnExec(fds[0]);
+		setCloseOnExec(fds[1]);
+		return 0;
+	}
+
+	/** The executable we're running from, so workers are the same xil as us, and not just whatever's in $PATH. */
+	StdString selfExecutable(StdStr argv0)
+	{
+#if defined(__linux__)
+		// Still works even if the file's been replaced or deleted since we started.
+		return "/proc/self/exe";
+#elif defined(__APPLE__)
+		uint32_t size = 0;
+		_NSGetExecutablePath(nullptr, &size);
+		StdString path(size, '\0');
+		if (_NSGetExecutablePath(path.data(), &size) == 0) {
+			path.resize(std::strlen(path.c_str()));
+			return path;
+		}
+#endif
+
+		// Otherwise, find it the way the shell that ran us would have.
+		if (argv0.contains('/')) {
+			return StdString{argv0};
+		}
+		if (char const *pathVar = std::getenv("PATH")) {
+			for (auto const dir : std::views::split(StdStr{pathVar}, ':')) {
+				auto const candidate = stdfs::path(StdStr{dir.begin(), dir.end()}) / argv0;
+				if (access(candidate.c_str(), X_OK) == 0) {
+					return candidate.string();
+				}
+			}
+		}
+		throw nix::Error("couldn't find the xil executable '%s' to start workers with", argv0);
+	}
+}
+
+bool isWorkerProcess()
+{
+	return std::getenv(WORKER_ENV_VAR) != nullptr;
+}
+
+void serveWorkerRequests(std::function<StdString(StdStr request)> const &handler, StdOpt<size_t> heapLimit)
+{
+	while (true) {
+		char tag;
+		ssize_t didRead = read(STDIN_FILENO, &tag, 1);
+		if (didRead < 0 && errno == EINTR) {
+			continue;
+		}
+		if (didRead <= 0) {
+			// The pool's done with us.
+			return;
+		}
+		if (tag != REQUEST_TAG) {
+			throw nix::Error("unexpected message from xil worker pool");
+		}
+
+		StdString const request = readFrame(STDIN_FILENO, WORKER_WHAT);
+		StdString const reply = handler(request);
+
+		bool const retiring = heapLimit.has_value() && GC_get_heap_size() > heapLimit.value();
+		writeFrame(STDOUT_FILENO, reply, WORKER_WHAT);
+		char const status = retiring ? STATUS_RETIRING : STATUS_READY;
+		writeAll(STDOUT_FILENO, &status, 1, WORKER_WHAT);
+
+		if (retiring) {
+			// The GC never gives memory back to the OS, so the only way to get it back is to start over.
+			return;
+		}
+	}
+}
+
+WorkerPool::WorkerPool(StdVec<StdString> argv, size_t jobs) :
+	argv(std::move(argv)),
+	executable(selfExecutable(this->argv.at(0))),
+	workers(std::max<size_t>(jobs, 1))
+{
+	for (Worker &worker : this->workers) {
+		this->spawn(worker);
+	}
+}
+
+WorkerPool::~WorkerPool()
+{
+	for (Worker &worker : this->workers) {
+		// Anything still working on something is only here because we're bailing out.
+		if (worker.request.has_value() && worker.pid > 0) {
+			kill(worker.pid, SIGTERM);
+		}
+		this->reap(worker);
+	}
+}
+
+void WorkerPool::spawn(Worker &worker)
+{
+	int toWorker[2];
+	int fromWorker[2];
+	if (pipeCloseOnExec(toWorker) < 0) {
+		throw nix::SysError("creating pipe for xil worker");
+	}
+	if (pipeCloseOnExec(fromWorker) < 0) {
+		close(toWorker[0]);
+		close(toWorker[1]);
+		throw nix::SysError("creating pipe for xil worker");
+	}
+
+	// Nothing between fork(2) and exec(2) may allocate, so get everything ready beforehand.
+	StdVec<char *> cArgv;
+	for (StdString &arg : this->argv) {
+		cArgv.push_back(arg.data());
+	}
+	cArgv.push_back(nullptr);
+
+	StdString workerEnv = fmt::format("{}=1", WORKER_ENV_VAR);
+	StdVec<char *> cEnv;
+	for (char **var = environ; *var != nullptr; ++var) {
+		cEnv.push_back(*var);
+	}
+	cEnv.push_back(workerEnv.data());
+	cEnv.push_back(nullptr);
+
+	pid_t const pid = fork();
+	if (pid < 0) {
+		throw nix::SysError("starting xil worker");
+	}
+
+	if (pid == 0) {
+		// dup2(2) leaves FD_CLOEXEC off the new descriptors, so these two survive the exec.
+		dup2(toWorker[0], STDIN_FILENO);
+		dup2(fromWorker[1], STDOUT_FILENO);
+		// Ignored signals stay ignored across exec(2), and the worker shouldn't inherit our SigpipeIgnored.
+		std::signal(SIGPIPE, SIG_DFL);
+		execve(this->executable.c_str(), cArgv.data(), cEnv.data());
+		_exit(127);
+	}
+
+	close(toWorker[0]);
+	close(fromWorker[1]);
+
+	worker.pid = pid;
+	worker.toWorker.reset(toWorker[1]);
+	worker.fromWorker.reset(fromWorker[0]);
+	worker.request = std::nullopt;
+}
+
+void WorkerPool::reap(Worker &worker)
+{
+	worker.toWorker.reset();
+	worker.fromWorker.reset();
+	if (worker.pid > 0) {
+		while (waitpid(worker.pid, nullptr, 0) < 0 && errno == EINTR) { }
+	}
+	worker.pid = -1;
+	worker.request = std::nullopt;
+}
+
+void WorkerPool::run(StdVec<StdString> const &requests, ReplyHandler const &onReply, bool inOrder)
+{
+	size_t nextToSend = 0;
+	size_t nextToEmit = 0;
+	size_t replied = 0;
+	// Replies that came back before the ones before them did.
+	std::map<size_t, StdOpt<StdString>> finished;
+
+	size_t const window = inOrder ? this->workers.size() * REORDER_WINDOW_PER_WORKER : requests.size();
+
+	auto const respawn = [&](Worker &worker) {
+		this->reap(worker);
+		this->spawn(worker);
+		this->restarts += 1;
+	};
+
+	while (replied < requests.size()) {
+		// Give everyone who's free something to do.
+		for (Worker &worker : this->workers) {
+			if (worker.request.has_value() || nextToSend >= requests.size() || nextToSend >= nextToEmit + window) {
+				continue;
+			}
+			try {
+				writeAll(worker.toWorker.fd, &REQUEST_TAG, 1, WORKER_WHAT);
+				writeFrame(worker.toWorker.fd, requests[nextToSend], WORKER_WHAT);
+			} catch (nix::SysError &) {
+				// It died between requests. Try again with a new one next time around.
+				respawn(worker);
+				continue;
+			}
+			worker.request = nextToSend;
+			nextToSend += 1;
+		}
+
+		// Wait for someone to finish.
+		StdVec<pollfd> pollFds;
+		StdVec<Worker *> polled;
+		for (Worker &worker : this->workers) {
+			if (worker.request.has_value()) {
+				pollFds.push_back(pollfd{.fd = worker.fromWorker.fd, .events = POLLIN, .revents = 0});
+				polled.push_back(&worker);
+			}
+		}
+
+		// Wake up every so often so ^C gets noticed.
+		int const ready = poll(pollFds.data(), pollFds.size(), 500);
+		nix::checkInterrupt();
+		if (ready < 0 && errno != EINTR) {
+			throw nix::SysError("waiting for xil workers");
+		}
+
+		for (size_t i = 0; i < pollFds.size(); ++i) {
+			if (pollFds[i].revents == 0) {
+				continue;
+			}
+			Worker &worker = *polled[i];
+			size_t const request = worker.request.value();
+
+			try {
+				finished[request] = readFrame(worker.fromWorker.fd, WORKER_WHAT);
+				char status;
+				readAll(worker.fromWorker.fd, &status, 1, WORKER_WHAT);
+				worker.request = std::nullopt;
+				if (status == STATUS_RETIRING) {
+					respawn(worker);
+				}
+			} catch (nix::Error &) {
+				// Crashed, or was killed (probably by the OOM killer) partway through.
+				finished[request] = std::nullopt;
+				respawn(worker);
+			}
+		}
+
+		// Hand back everything we can, in order if need be.
+		for (auto it = finished.begin(); it != finished.end(); ) {
+			if (inOrder && it->first != nextToEmit) {
+				break;
+			}
+			onReply(it->first, std::move(it->second));
+			it = finished.erase(it);
+			nextToEmit += 1;
+			replied += 1;
+		}
+	}
+}
@@ -0,0 +1,73 @@
+// Farming work out to other xil processes, since Lix's evaluator is single-threaded.
+
+#pragma once
+
+#include <cstddef>
+#include <functional>
+
+#include <sys/types.h>
+
+#include "fdio.hpp"
+#include "std/optional.hpp"
+#include "std/string.hpp"
+#include "std/string_view.hpp"
+#include "std/vector.hpp"
+
+/** Whether we're a worker started by a WorkerPool, rather than something a human ran. */
+[[nodiscard]]
+bool isWorkerProcess();
+
+/** Runs in a worker: answers requests from the WorkerPool that started us with `handler`,
+ * until the pool is done with us, or the GC heap grows past `heapLimit` bytes,
+ * at which point we tell the pool to replace us with a fresh worker.
+ */
+void serveWorkerRequests(std::function<StdString(StdStr request)> const &handler, StdOpt<size_t> heapLimit);
+
+/** A pool of worker processes, each of which is xil re-run with the same arguments,
+ * in the same directory, which then calls `serveWorkerRequests()` when it gets to the part worth sharding.
+ */
+struct WorkerPool
+{
+	/** Called with each request's reply, or std::nullopt if the worker died while working on it. */
+	using ReplyHandler = std::function<void(size_t index, StdOpt<StdString> reply)>;
+
+	/** `argv` is what to start each worker with, including argv[0]. */
+	WorkerPool(StdVec<StdString> argv, size_t jobs);
+
+	WorkerPool(WorkerPool const &) = delete;
+	WorkerPool &operator=(WorkerPool const &) = delete;
+
+	/** Closes all the workers' stdins, which tells them to exit, and waits for them to do so. */
+	~WorkerPool();
+
+	/** Hands each of `requests` to whichever worker is free,
+	 * and calls `onReply` with each reply in the same order as `requests`, as soon as it can.
+	 * Without `inOrder`, replies are handed back as soon as they come in instead.
+	 */
+	void run(StdVec<StdString> const &requests, ReplyHandler const &onReply, bool inOrder = true);
+
+	/** How many workers have been replaced, for having outgrown their heap limit or died. */
+	size_t restarts = 0;
+
+private:
+	struct Worker
+	{
+		pid_t pid = -1;
+		OwnedFd toWorker;
+		OwnedFd fromWorker;
+		// What it's working on, if anything.
+		StdOpt<size_t> request;
+	};
+
+	// We'd rather hear about a worker dying from write(2) than be killed for it.
+	// Declared first so it outlasts the workers.
+	SigpipeIgnored sigpipeIgnored;
+
+	StdVec<StdString> argv;
+	// Resolved up front, since nothing between fork(2) and exec(2) may allocate.
+	StdString executable;
+	StdVec<Worker> workers;
+
+	void spawn(Worker &worker);
+	void reap(Worker &worker);
+};
@@ -1,7 +1,11 @@
 #include "xil.hpp"
 
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
 #include <iterator>
+#include <sstream>
 
 // Lix headers.
 #include <lix/libexpr/nixexpr.hh>
@@ -14,6 +18,7 @@
 #include <fmt/ranges.h>
 
 #include "attriter.hpp"
+#include "output.hpp"
 
 using namespace std::literals::string_literals;
 
@@ -47,46 +52,49 @@ StdStr nix::format_as(nix::ValueType const type) noexcept
 	}
 }
 
-/** Attempts to get the error message itself (without traces) from a Nix error string. */
-OptStringView stringErrorLine(StdStr sv)
+namespace
 {
-	StdStr const searchingFor = "error:\x1b[0m";
-	auto errorStart = sv.rfind(searchingFor);
-	if (errorStart == decltype(sv)::npos) {
-		return std::nullopt;
-	}
-
-	auto newline = sv.find("\n", errorStart);
-
-	auto start = errorStart + searchingFor.size() + 1;
-
-	return sv.substr(start, newline - start);
+	/** Gets at the ErrorInfo an error was constructed with.
+	 * BaseError::info() and BaseError::msg() render the whole error, traces and source excerpts and all,
+	 * which is far more expensive than anything else we do with an error we're about to summarize.
+	 * `err` is protected, but a pointer-to-member formed from a derived class can still read it.
+	 */
+	struct ErrorInfoAccess : nix::BaseError
+	{
+		static nix::ErrorInfo const &of(nix::BaseError const &ex)
+		{
+			return ex.*(&ErrorInfoAccess::err);
+		}
+	};
 }
 
-std::optional<nix::SymbolStr> Printer::symbol(nix::Symbol &&symbol)
+/** Gets the first line of an error's own message, without formatting any of its traces. */
+static StdString errorSummary(nix::BaseError const &ex)
 {
-	if (!symbol) {
-		return std::nullopt;
+	StdString summary = ErrorInfoAccess::of(ex).msg.str();
+	auto const newline = summary.find('\n');
+	if (newline != StdString::npos) {
+		summary.resize(newline);
 	}
-
-	return this->state->ctx.symbols[symbol];
+	return summary;
 }
 
-OptString Printer::symbolStr(nix::Symbol const &symbol)
+std::optional<nix::SymbolStr> Printer::symbol(nix::Symbol &&symbol)
 {
 	if (!symbol) {
 		return std::nullopt;
 	}
 
-	return static_cast<StdString>(this->state->ctx.symbols[symbol]);
+	return this->state->ctx.symbols[symbol];
 }
 
-OptStringView Printer::symbolStrView(nix::Symbol &symbol)
+OptStringView Printer::symbolStr(nix::Symbol const &symbol)
 {
 	if (!symbol) {
 		return std::nullopt;
 	}
 
+	this->stats.symbolNames += 1;
 	return static_cast<StdStr>(this->state->ctx.symbols[symbol]);
 }
 
@@ -94,27 +102,28 @@ nix::Value *Printer::getAttrValue(nix::Bindings *attrs, nix::Symbol key)
 {
 	assert(attrs != nullptr);
 
-	auto *found = attrs->find(key);
-
-	assert(found != nullptr);
+	auto *found = attrs->get(key);
+	if (found == nullptr) {
+		return nullptr;
+	}
 
 	return found->value;
 }
 
 nix::Value *Printer::getAttrValue(nix::Bindings *attrs, StdStr key)
 {
-	// FIXME: does this...work?
-	for (auto &&attr : *attrs) {
-		auto attrName = this->symbolStrView(attr.name);
-		if (attrName == key) {
-			return attr.value;
-		}
+	assert(attrs != nullptr);
+
+	// Intern the key so we get Bindings' binary search, rather than comparing strings for every attr.
+	auto *found = attrs->get(this->state->ctx.symbols.create(key));
+	if (found == nullptr) {
+		return nullptr;
 	}
 
-	return nullptr;
+	return found->value;
 }
 
-OptString Printer::exprName(nix::Expr *expr)
+OptStringView Printer::exprName(nix::Expr *expr)
 {
 	assert(expr != nullptr);
 
@@ -124,25 +133,29 @@ OptString Printer::exprName(nix::Expr *expr)
 	auto polymorphicExpr = ExprT::from(expr);
 
 	return std::visit(overloaded{
-		[&](nix::ExprVar *expr) -> OptString {
+		[&](nix::ExprVar *expr) -> OptStringView {
 			// FIXME: Can a variable have an invalid Symbol as its name?
 			assert(expr->name);
 
 			// Variables have a name. Use it!
 			return this->symbolStr(expr->name);
 		},
-		[&](nix::ExprLambda *expr) -> OptString {
+		[&](nix::ExprLambda *expr) -> OptStringView {
 			// If this lambda has a name, then use that.
 			if (expr->name) {
 				return this->symbolStr(expr->name);
 			}
 			return std::nullopt;
 		},
-		[&](nix::ExprCall *) -> OptString {
+		[&](nix::ExprCall *) -> OptStringView {
 			// TODO: should this use the name of the function its calling?
 			return std::nullopt;
 		},
-		[&](auto *) -> OptString {
+		[&](auto *) -> OptStringView {
+			return std::nullopt;
+		},
+		[&](std::monostate) -> OptStringView {
+			// Some kind of expression we don't know about.
 			return std::nullopt;
 		},
 	}, polymorphicExpr);
@@ -166,7 +179,10 @@ OptString Printer::valueName(nix::Value &value)
 			// Their union members are different, though, so we need to check each case.
 			if (value.isLambda()) {
 				assert(value.lambda.fun != nullptr);
-				return this->exprName(value.lambda.fun);
+				if (auto const name = this->exprName(value.lambda.fun)) {
+					return StdString{name.value()};
+				}
+				return std::nullopt;
 			} else if (value.isPrimOp()) {
 				assert(value.primOp != nullptr);
 				return value.primOp->name;
@@ -187,11 +203,17 @@ OptString Printer::valueName(nix::Value &value)
 	}
 }
 
+// TODO: allow configuring the indentation size.
+static constexpr uint32_t INDENT_WIDTH = 4;
+
 static void printIndent(std::ostream &out, uint32_t indentLevel)
 {
-	// TODO: allow configuring the indentation size.
-	for ([[maybe_unused]] uint32_t i : iter::range(indentLevel * 4)) {
-		out << " ";
+	// Write spaces in chunks, rather than one at a time.
+	static constexpr StdStr spaces = "                                                                ";
+	for (size_t remaining = indentLevel * INDENT_WIDTH; remaining > 0; ) {
+		auto const chunk = std::min(remaining, spaces.size());
+		out.write(spaces.data(), static_cast<std::streamsize>(chunk));
+		remaining -= chunk;
 	}
 }
 
@@ -205,136 +227,1217 @@ std::ostream &operator<<(std::ostream &out, Indent const &self)
 // A formatter for fmt::format().
 StdString format_as(Indent const indentation)
 {
-	std::stringstream ss;
-	printIndent(ss, indentation.level);
-	return ss.str();
+	return StdString(indentation.level * INDENT_WIDTH, ' ');
+}
+
+// Appends the escaped form of a single line (no '\n') of a Nix string to `buffer`.
+// Runs of characters that don't need escaping are found with memchr(3), which is vectorized
+// in any libc worth using, and appended in bulk.
+static void appendEscapedLine(StdString &buffer, StdStr line, bool multiline)
+{
+	char const *const begin = line.data();
+	char const *const end = line.data() + line.size();
+
+	// The next occurrences of the two characters we care about, or `end` if there are none left.
+	auto findNext = [end](char const *from, char needle) -> char const * {
+		auto const *found = static_cast<char const *>(std::memchr(from, needle, static_cast<size_t>(end - from)));
+		return (found != nullptr) ? found : end;
+	};
+	char const *nextCarriageReturn = findNext(begin, '\r');
+	char const *nextDollar = findNext(begin, '$');
+
+	char const *runStart = begin;
+	while (runStart != end) {
+		char const *special = std::min(nextCarriageReturn, nextDollar);
+		buffer.append(runStart, special);
+		if (special == end) {
+			break;
+		}
+
+		if (*special == '\r') {
+			buffer.append("\\r");
+			nextCarriageReturn = findNext(special + 1, '\r');
+		} else {
+			// A `${` needs to be escaped, and the escape mechanism depends on whether or not it's a '' string.
+			bool const startsInterpolation = (special + 1 != end) && special[1] == '{';
+			if (startsInterpolation) {
+				buffer.append(multiline ? "''$" : "$$");
+			} else {
+				buffer.push_back('$');
+			}
+			nextDollar = findNext(special + 1, '$');
+		}
+
+		runStart = special + 1;
+	}
 }
 
 // Prints single-line strings in quotes, and multiline strings as a '' string, formatted nicely.
 StdString prettyString(StdStr nixString, uint32_t indentLevel)
 {
-	// TODO: this, or std::stringstream?
-	auto buffer = fmt::memory_buffer();
+	bool const multiline = std::memchr(nixString.data(), '\n', nixString.size()) != nullptr;
+
+	StdString buffer;
+
+	if (!multiline) {
+		// Escapes make it a bit longer, but usually not by much.
+		buffer.reserve(nixString.size() + 2);
+		buffer.push_back('"');
+		appendEscapedLine(buffer, nixString, false);
+		buffer.push_back('"');
+		return buffer;
+	}
+
+	// + 1 because things indented in the string need to be indented *further* than the string.
+	StdString const lineIndent = format_as(Indent{indentLevel + 1});
+
+	buffer.reserve(nixString.size() + 8 * lineIndent.size() + 6);
+	buffer.append("''\n");
 
-	bool multiline = nixString.find("\n") != decltype(nixString)::npos;
-	if (multiline) {
-		fmt::format_to(std::back_inserter(buffer), "''\n");
+	// Indent and escape the string one line at a time.
+	size_t lineStart = 0;
+	while (true) {
+		size_t const newline = nixString.find('\n', lineStart);
+		if (newline == StdStr::npos) {
+			break;
+		}
+
+		buffer.append(lineIndent);
+		appendEscapedLine(buffer, nixString.substr(lineStart, newline - lineStart), true);
+		buffer.push_back('\n');
+		lineStart = newline + 1;
+	}
+
+	StdStr const lastLine = nixString.substr(lineStart);
+	if (lastLine.empty()) {
+		// No more + 1 for the last part, since this is the closing part of the string.
+		buffer.append(format_as(Indent{indentLevel}));
 	} else {
-		fmt::format_to(std::back_inserter(buffer), "\"");
+		buffer.append(lineIndent);
+		appendEscapedLine(buffer, lastLine, true);
 	}
 
-	bool needsIndent = multiline;
+	buffer.append("''");
+
+	return buffer;
+}
 
-	for (auto &&ch : nixString) {
-		if (needsIndent) {
-			// + 1 because things indented in the string need to be indented *further* than the string.
-			fmt::format_to(std::back_inserter(buffer), "{}", Indent{indentLevel + 1});
-			needsIndent = false;
+void printJsonString(std::ostream &out, StdStr str)
+{
+	out << '"';
+
+	// Write out runs of characters that don't need escaping all at once.
+	size_t runStart = 0;
+	for (size_t i = 0; i < str.size(); ++i) {
+		auto const ch = static_cast<unsigned char>(str[i]);
+		if (ch >= 0x20 && ch != '"' && ch != '\\') {
+			continue;
 		}
 
+		out.write(str.data() + runStart, static_cast<std::streamsize>(i - runStart));
+		runStart = i + 1;
+
 		switch (ch) {
+			case '"':
+				out << "\\\"";
+				break;
 			case '\\':
-				fmt::format_to(std::back_inserter(buffer), "\\");
+				out << "\\\\";
 				break;
 			case '\n':
-				if (multiline) {
-					fmt::format_to(std::back_inserter(buffer), "\n");
-					needsIndent = true;
-				} else {
-					fmt::format_to(std::back_inserter(buffer), "\\n");
-				}
+				out << "\\n";
 				break;
 			case '\r':
-				fmt::format_to(std::back_inserter(buffer), "\\r");
+				out << "\\r";
+				break;
+			case '\t':
+				out << "\\t";
+				break;
+			default:
+				out << fmt::format("\\u{:04x}", ch);
 				break;
-			case '$': {
-				// Minor hack: check if the next character is an open brace, which we will need to escape.
-				auto *next = (&ch + 1);
-				if (next != nixString.end() && *next == '{') {
-					// The escape mechanism depends on whether or not it's a '' string.
-					if (multiline) {
-						fmt::format_to(std::back_inserter(buffer), "''$");
+		}
+	}
+	out.write(str.data() + runStart, static_cast<std::streamsize>(str.size() - runStart));
+
+	out << '"';
+}
+
+OutputFormat parseOutputFormat(StdStr name)
+{
+	if (name == "json") {
+		return OutputFormat::JSON;
+	} else if (name == "ndjson") {
+		return OutputFormat::NDJSON;
+	}
+	assert(name == "nix");
+	return OutputFormat::NIX;
+}
+
+RepeatScope parseRepeatScope(StdStr name)
+{
+	if (name == "global") {
+		return RepeatScope::GLOBAL;
+	}
+	assert(name == "path");
+	return RepeatScope::PATH;
+}
+
+void Printer::printMarker(std::ostream &out, StdStr kind, StdStr detail)
+{
+	if (!this->isJson()) {
+		out << "«" << detail << "»";
+		return;
+	}
+
+	out << "{";
+	printJsonString(out, fmt::format("${}", kind));
+	out << ":";
+	printJsonString(out, detail);
+	out << "}";
+}
+
+void Printer::printAttrs(nix::Bindings *attrs, std::ostream &out, uint32_t indentLevel, uint32_t depth, AttrsFilter filter)
+{
+	if (depth == 0) {
+		this->outputStart = out.tellp();
+	}
+
+	StdVec<PrintFrame> stack;
+	this->openAttrs(attrs, out, indentLevel, depth, stack, filter);
+	this->printPending(stack, out);
+}
+
+void Printer::openAttrs(
+	nix::Bindings *attrs,
+	std::ostream &out,
+	uint32_t indentLevel,
+	uint32_t depth,
+	StdVec<PrintFrame> &stack,
+	AttrsFilter filter
+)
+{
+	// FIXME: better heuristics for short attrsets.
+	if (attrs->empty()) {
+		out << (this->isJson() ? "{}" : "{ }");
+		return;
+	}
+
+	// FIXME: hardcodes pkgs recursion.
+	nix::Attr const *typeAttr = attrs->get(this->typeSymbol);
+	bool isPkgs = typeAttr != nullptr
+		&& typeAttr->value->type() == nix::nString
+		&& typeAttr->value->str() == "pkgs"s;
+	if (isPkgs && indentLevel > 0) {
+		this->printMarker(out, "elided", "too deep");
+		return;
+	}
+
+	// With RepeatScope::PATH, this comes back out of `seen` when its frame is done.
+	if (!this->seen.insert(attrs)) {
+		std::stringstream names;
+		this->printRepeatedAttrs(attrs, names);
+		this->printMarker(out, "repeated", fmt::format("repeated{}", names.str()));
+		return;
+	}
+
+	size_t const outputOffset = this->dedupOffset(out);
+	out << "{";
+	stack.push_back(PrintFrame{
+		.attrs = attrs,
+		.count = attrs->size(),
+		.indentLevel = indentLevel,
+		.depth = depth,
+		.outputOffset = outputOffset,
+		.filter = filter,
+	});
+}
+
+void Printer::openList(nix::Value &list, std::ostream &out, uint32_t indentLevel, uint32_t depth, StdVec<PrintFrame> &stack)
+{
+	// FIXME: better heuristics for short lists
+	// Things like `outputs = [ "out" ]` are annoying printed multiline.
+	if (list.listSize() == 0) {
+		out << (this->isJson() ? "[]" : "[ ]");
+		return;
+	}
+
+	bool const byName = this->view.byName && this->isDerivationList(list, depth);
+	size_t const outputOffset = this->dedupOffset(out);
+	out << (byName ? "{" : "[");
+	stack.push_back(PrintFrame{
+		.list = &list,
+		.count = list.listSize(),
+		.indentLevel = indentLevel,
+		.depth = depth,
+		.outputOffset = outputOffset,
+		.byName = byName,
+	});
+}
+
+bool Printer::isDeduplicating(std::ostream const &out) const noexcept
+{
+	return this->dedup != nullptr && out.rdbuf() == &this->dedup->buffer;
+}
+
+size_t Printer::dedupOffset(std::ostream const &out) const noexcept
+{
+	return this->isDeduplicating(out) ? this->dedup->buffer.size() : 0;
+}
+
+void Printer::printPending(StdVec<PrintFrame> &stack, std::ostream &out)
+{
+	while (!stack.empty()) {
+		// Careful: this is invalidated as soon as anything else gets pushed.
+		PrintFrame &frame = stack.back();
+		StdStr const noun = frame.isAttrs() ? "attr" : "item";
+
+		// We're back from printing the last item's value, so finish it off.
+		if (frame.itemOpen) {
+			this->currentPath.pop_back();
+			if (frame.printsAsAttrs() && !this->isJson()) {
+				out << ";";
+			}
+			frame.itemOpen = false;
+			frame.index += 1;
+		}
+
+		while (frame.index < frame.count && this->skipItem(frame)) {
+			frame.index += 1;
+			frame.skipped += 1;
+		}
+		size_t const printedCount = frame.index - frame.skipped;
+
+		// Check budgets before we print (and so force) anything.
+		auto const maxItems = frame.isAttrs() ? this->budget.maxAttrsPerSet : this->budget.maxListItems;
+		bool const elidedRest = frame.index < frame.count && this->overBudget(out, printedCount, maxItems);
+		if (elidedRest) {
+			this->printElidedRest(out, frame.count - frame.index, noun, frame.printsAsAttrs(), frame.indentLevel, printedCount == 0);
+			frame.index = frame.count;
+		}
+
+		if (frame.index >= frame.count) {
+			if (frame.duplicates > 0) {
+				auto const what = fmt::format("{} {} with repeated names", frame.duplicates, maybePluralize(frame.duplicates, noun));
+				this->printElided(out, "duplicates", what, true, frame.indentLevel, printedCount == 0 && !elidedRest);
+			}
+
+			if (this->isJson()) {
+				out << (frame.printsAsAttrs() ? "}" : "]");
+			} else {
+				out << "\n" << Indent{frame.indentLevel} << (frame.printsAsAttrs() ? "}" : "]");
+			}
+
+			// It's no longer an ancestor of anything we print next.
+			if (frame.isAttrs() && this->repeatScope == RepeatScope::PATH) {
+				this->seen.erase(frame.attrs);
+			}
+
+			// The top level can't be the same as anything else, and there'd be nothing left to refer to.
+			if (frame.depth > 0 && this->isDeduplicating(out)) {
+				auto const indent = this->isJson() ? 0 : frame.indentLevel * INDENT_WIDTH;
+				// Remembered in the form it'll be referred to by.
+				auto const path = this->isJson() ? renderJsonAttrPath(this->currentPath) : renderAttrPath(this->currentPath);
+				if (auto const firstPath = this->dedup->findOrRemember(frame.outputOffset, indent, path)) {
+					if (this->isJson()) {
+						out << "{\"$same\":" << firstPath.value() << "}";
 					} else {
-						fmt::format_to(std::back_inserter(buffer), "$$");
+						this->printMarker(out, "same", fmt::format("same as {}", firstPath.value()));
 					}
+				}
+			}
+
+			stack.pop_back();
+			continue;
+		}
+
+		if (this->isJson() && printedCount > 0) {
+			out << ",";
+		}
+
+		nix::Value *item;
+		AttrsFilter childFilter = AttrsFilter::NONE;
+		if (frame.isAttrs()) {
+			nix::Attr const &attr = *(frame.attrs->begin() + frame.index);
+			auto const name = static_cast<StdStr>(this->state->ctx.symbols[attr.name]);
+			if (this->isJson()) {
+				printJsonString(out, name);
+				out << ":";
+			} else {
+				out << "\n" << Indent{frame.indentLevel + 1} << name << " = ";
+			}
+			this->currentAttrName = name;
+			this->currentPath.push_back(AttrPathElem{.name = name});
+			item = attr.value;
+
+			if (frame.filter == AttrsFilter::CLEAN_DERIVATION && attr.name == this->state->ctx.s.meta) {
+				childFilter = AttrsFilter::SHORT_META;
+			} else if (frame.filter == AttrsFilter::SHORT_META && attr.name == this->viewSymbols.license) {
+				childFilter = AttrsFilter::LICENSE_SPDX;
+			}
+		} else {
+			item = *(frame.list->listItems().begin() + frame.index);
+			if (frame.byName) {
+				if (this->isJson()) {
+					printJsonString(out, frame.itemKey);
+					out << ":";
 				} else {
-					fmt::format_to(std::back_inserter(buffer), "$");
+					// Names like `python3.12-foo`, or an index for something without one, aren't valid bare attr names.
+					out << "\n" << Indent{frame.indentLevel + 1};
+					nix::printAttributeName(out, frame.itemKey);
+					out << " = ";
 				}
-				break;
+				this->currentPath.push_back(AttrPathElem{.name = frame.itemKey});
+			} else {
+				if (!this->isJson()) {
+					out << "\n" << Indent{frame.indentLevel + 1};
+				}
+				this->currentPath.push_back(AttrPathElem{.listIndex = frame.index});
 			}
-			// FIXME: allow custom size for \t
-			default:
-				fmt::format_to(std::back_inserter(buffer), "{:c}", ch);
-				break;
 		}
+		frame.itemOpen = true;
+
+		// This might push a frame of its own, which we'll get to next time around.
+		this->beginValue(*item, out, frame.indentLevel + 1, frame.depth + 1, stack, childFilter);
 	}
+}
 
-	if (needsIndent) {
-		// No more + 1 for the last part, since this is the closing part of the string.
-		fmt::format_to(std::back_inserter(buffer), "{}", Indent{indentLevel});
+AttrsFilter Printer::derivationFilter() const noexcept
+{
+	return this->view.cleanup ? AttrsFilter::CLEAN_DERIVATION : AttrsFilter::NONE;
+}
+
+bool Printer::skipItem(PrintFrame &frame)
+{
+	if (frame.byName) {
+		nix::Value &item = **(frame.list->listItems().begin() + frame.index);
+		auto key = this->byNameKey(item, frame.depth + 1).value_or(fmt::format("{}", frame.index));
+		auto const [taken, isNew] = frame.byNameKeys.insert(std::move(key));
+		if (!isNew) {
+			frame.duplicates += 1;
+			return true;
+		}
+		frame.itemKey = *taken;
+		return false;
 	}
 
-	if (multiline) {
-		fmt::format_to(std::back_inserter(buffer), "''");
-	} else {
-		fmt::format_to(std::back_inserter(buffer), "\"");
+	if (!frame.isAttrs()) {
+		return false;
+	}
+
+	nix::Attr const &attr = *(frame.attrs->begin() + frame.index);
+	switch (frame.filter) {
+		case AttrsFilter::NONE:
+			return false;
+		case AttrsFilter::CLEAN_DERIVATION: {
+			// These are redundant.
+			if (attr.name == this->viewSymbols.drvAttrs) {
+				return true;
+			}
+			// We can only tell it's an empty list by forcing it, same as cleanupDrv's filterAttrs does.
+			if (attr.value->isThunk() && !this->mayForce(frame.depth + 1)) {
+				return false;
+			}
+			if (this->safeForce(*attr.value).has_value()) {
+				// Don't hide errors.
+				return false;
+			}
+			return attr.value->type() == nix::nList && attr.value->listSize() == 0;
+		}
+		case AttrsFilter::SHORT_META:
+			return attr.name == this->viewSymbols.platforms || attr.name == this->viewSymbols.maintainers;
+		case AttrsFilter::LICENSE_SPDX:
+			return attr.name != this->viewSymbols.spdxId;
+	}
+
+	return false;
+}
+
+bool Printer::isDerivationList(nix::Value &list, uint32_t depth)
+{
+	// Only the items that'll actually be printed, so --max-list-items still keeps the rest from being evaluated.
+	size_t const count = std::min(list.listSize(), this->budget.maxListItems.value_or(list.listSize()));
+	for (size_t index = 0; index < count; ++index) {
+		nix::Value *item = *(list.listItems().begin() + index);
+		if (item->isThunk() && !this->mayForce(depth + 1)) {
+			return false;
+		}
+		if (this->safeForce(*item).has_value() || item->type() != nix::nAttrs) {
+			return false;
+		}
+		if (!this->isDerivation(*item, depth + 1)) {
+			return false;
+		}
 	}
 
-	return fmt::to_string(buffer);
+	return true;
 }
 
-void Printer::printAttrs(nix::Bindings *attrs, std::ostream &out, uint32_t indentLevel, uint32_t depth)
+OptString Printer::byNameKey(nix::Value &item, uint32_t depth)
 {
-	auto attrIter = AttrIterable(attrs, this->state->ctx.symbols);
+	auto const forced = [&](nix::Value &value) {
+		if (value.isThunk() && !this->mayForce(depth)) {
+			return false;
+		}
+		return !this->safeForce(value).has_value();
+	};
 
-	// FIXME: better heuristics for short attrsets.
-	if (attrIter.empty()) {
-		out << "{ }";
+	if (!forced(item) || item.type() != nix::nAttrs) {
+		return std::nullopt;
+	}
+
+	// Like drvListByName's `val.pname or val.name`.
+	for (nix::Symbol const name : { this->viewSymbols.pname, this->state->ctx.s.name }) {
+		nix::Value *attr = this->getAttrValue(item.attrs, name);
+		if (attr != nullptr && forced(*attr) && attr->type() == nix::nString) {
+			return StdString{attr->str()};
+		}
+	}
+
+	return std::nullopt;
+}
+
+void Printer::printCursor(std::shared_ptr<nix::eval_cache::AttrCursor> const &cursor, std::ostream &out, bool expandDerivation)
+{
+	this->outputStart = out.tellp();
+
+	StdVec<CursorFrame> stack;
+	this->beginCursor(cursor, out, 0, 0, stack, expandDerivation);
+	this->printPendingCursors(stack, out);
+}
+
+void Printer::beginCursor(
+	std::shared_ptr<nix::eval_cache::AttrCursor> const &cursor,
+	std::ostream &out,
+	uint32_t indentLevel,
+	uint32_t depth,
+	StdVec<CursorFrame> &stack,
+	bool expandDerivation
+)
+{
+	nix::checkInterrupt();
+
+	if (this->budget.maxDepth.has_value() && depth > this->budget.maxDepth.value()) {
+		this->printMarker(out, "elided", "too deep");
 		return;
 	}
 
-	if (!this->seen.insert(attrs).second) {
-		out << "«repeated";
-		this->printRepeatedAttrs(attrs, out);
-		out << "»";
+	// Anything not in the eval cache yet has to be evaluated, which can take arbitrarily long.
+	aboutToBlock(out);
+
+	// The eval cache doesn't tell us what type something is, only whether it's the type we asked for,
+	// so ask for each of the types it keeps in turn. Asking for the wrong one is a TypeError.
+	StdOpt<StdVec<nix::Symbol>> names;
+	bool printed = false;
+	OptString maybeErrorMessage = this->safely([&]() {
+		try {
+			names = cursor->getAttrs(*this->state);
+			return;
+		} catch (nix::TypeError &) {
+			// Not an attrset. If this was actually a type error evaluating it, we'll run into it again below.
+		}
+		printed = this->printCursorLeaf(*cursor, out, indentLevel);
+	});
+	if (maybeErrorMessage.has_value()) {
+		this->printMarker(out, "error", maybeErrorMessage.value());
+		return;
+	}
+	if (printed) {
 		return;
 	}
 
-	// FIXME: hardcodes pkgs recursion.
-	auto typeIsPkgs = std::ranges::find_if(
-		attrIter,
-		[](std::tuple<StdStr const, nix::Value const &> pair) -> bool {
-			auto const &[name, value] = pair;
-			return name == "_type" && value.type() == nix::nString && value.str() == "pkgs"s;
+	if (!names.has_value()) {
+		// Lists of anything but strings, functions, and anything else the eval cache doesn't keep, so print the value itself.
+		nix::Value *value = nullptr;
+		maybeErrorMessage = this->safely([&]() {
+			value = &cursor->forceValue(*this->state);
+		});
+		if (maybeErrorMessage.has_value()) {
+			this->printMarker(out, "error", maybeErrorMessage.value());
+			return;
 		}
-	);
+		StdVec<PrintFrame> valueStack;
+		this->beginValue(*value, out, indentLevel, depth, valueStack);
+		this->printPending(valueStack, out);
+		return;
+	}
 
-	bool isPkgs = typeIsPkgs != attrIter.end();
+	bool isDerivation = false;
+	bool isPkgs = false;
+	maybeErrorMessage = this->safely([&]() {
+		isDerivation = this->cursorStringAttr(*cursor, this->state->ctx.s.type) == "derivation";
+		// FIXME: hardcodes pkgs recursion.
+		isPkgs = this->cursorStringAttr(*cursor, this->typeSymbol) == "pkgs";
+	});
+	if (maybeErrorMessage.has_value()) {
+		this->printMarker(out, "error", maybeErrorMessage.value());
+		return;
+	}
+
+	if (isDerivation && this->shortDerivations && !expandDerivation) {
+		if (this->cheapDerivations) {
+			OptString name;
+			// Without a name this is still a derivation, so failing to get one isn't worth an error marker.
+			this->safely([&]() {
+				name = this->cursorStringAttr(*cursor, this->state->ctx.s.name);
+			});
+			this->printMarker(out, "derivation", fmt::format("derivation {}", name.value_or("???")));
+			return;
+		}
+
+		OptString drvPath;
+		maybeErrorMessage = this->safely([&]() {
+			drvPath = this->cursorStringAttr(*cursor, this->state->ctx.s.drvPath);
+		});
+		if (maybeErrorMessage.has_value()) {
+			if (this->isJson()) {
+				this->printMarker(out, "error", maybeErrorMessage.value());
+			} else {
+				out << "«derivation «" << maybeErrorMessage.value() << "»»";
+			}
+		} else if (!drvPath.has_value()) {
+			this->printMarker(out, "derivation", "derivation ???");
+		} else if (this->isJson()) {
+			this->printMarker(out, "derivation", drvPath.value());
+		} else {
+			out << "«derivation " << drvPath.value() << "»";
+		}
+		return;
+	}
+
+	// Cursors don't have an identity we can check for cycles like `seen` does, so this and `maxDepth` are all we've got.
 	if (isPkgs && indentLevel > 0) {
-		out << "«too deep»";
+		this->printMarker(out, "elided", "too deep");
+		return;
+	}
+
+	if (names->empty()) {
+		out << (this->isJson() ? "{}" : "{ }");
 		return;
 	}
 
 	out << "{";
+	stack.push_back(CursorFrame{
+		.cursor = cursor,
+		.names = std::move(names.value()),
+		.indentLevel = indentLevel,
+		.depth = depth,
+	});
+}
 
-	for (auto const &[name, value] : attrIter) {
-		out << "\n" << Indent{indentLevel + 1} << name << " = ";
-		std::flush(out);
+bool Printer::printCursorLeaf(nix::eval_cache::AttrCursor &cursor, std::ostream &out, uint32_t indentLevel)
+{
+	nix::EvalState &state = *this->state;
+
+	try {
+		auto const [str, context] = cursor.getStringWithContext(state);
+		// This takes paths too, and the eval cache keeps them as plain strings, so anything that might be a path
+		// has to be checked against the value itself. Strings with context (store paths) never are, though,
+		// and checking those would mean instantiating every derivation we print the outPath of.
+		bool const isPath = context.empty() && str.starts_with('/') && cursor.forceValue(state).type() == nix::nPath;
+		if (this->isJson()) {
+			printJsonString(out, str);
+		} else if (isPath) {
+			out << str;
+		} else {
+			out << prettyString(str, indentLevel);
+		}
+		return true;
+	} catch (nix::TypeError &) {
+	}
+
+	try {
+		out << cursor.getInt(state);
+		return true;
+	} catch (nix::TypeError &) {
+	}
+
+	try {
+		nix::printLiteralBool(out, cursor.getBool(state));
+		return true;
+	} catch (nix::TypeError &) {
+	}
+
+	// The only kind of list the eval cache keeps, but a common one (`outputs`, `meta.platforms`, …).
+	try {
+		auto const strings = cursor.getListOfStrings(state);
+		this->printCursorStrings(strings, out, indentLevel);
+		return true;
+	} catch (nix::TypeError &) {
+	}
+
+	return false;
+}
+
+void Printer::printCursorStrings(StdVec<StdString> const &strings, std::ostream &out, uint32_t indentLevel)
+{
+	if (strings.empty()) {
+		out << (this->isJson() ? "[]" : "[ ]");
+		return;
+	}
+
+	out << "[";
+	for (auto const &[index, str] : iter::enumerate(strings)) {
+		if (this->overBudget(out, index, this->budget.maxListItems)) {
+			this->printElidedRest(out, strings.size() - index, "item", false, indentLevel, index == 0);
+			break;
+		}
+		if (this->isJson()) {
+			if (index > 0) {
+				out << ",";
+			}
+			printJsonString(out, str);
+		} else {
+			out << "\n" << Indent{indentLevel + 1} << prettyString(str, indentLevel + 1);
+		}
+	}
+	if (this->isJson()) {
+		out << "]";
+	} else {
+		out << "\n" << Indent{indentLevel} << "]";
+	}
+}
+
+OptString Printer::cursorStringAttr(nix::eval_cache::AttrCursor &cursor, nix::Symbol name)
+{
+	auto const attr = cursor.maybeGetAttr(*this->state, name);
+	if (attr == nullptr) {
+		return std::nullopt;
+	}
+	try {
+		return attr->getString(*this->state);
+	} catch (nix::TypeError &) {
+		return std::nullopt;
+	}
+}
+
+void Printer::printPendingCursors(StdVec<CursorFrame> &stack, std::ostream &out)
+{
+	while (!stack.empty()) {
+		// Careful: this is invalidated as soon as anything else gets pushed.
+		CursorFrame &frame = stack.back();
+
+		if (frame.itemOpen) {
+			this->currentPath.pop_back();
+			if (!this->isJson()) {
+				out << ";";
+			}
+			frame.itemOpen = false;
+			frame.index += 1;
+		}
+
+		size_t const count = frame.names.size();
+		if (frame.index < count && this->overBudget(out, frame.index, this->budget.maxAttrsPerSet)) {
+			this->printElidedRest(out, count - frame.index, "attr", true, frame.indentLevel, frame.index == 0);
+			frame.index = count;
+		}
+
+		if (frame.index >= count) {
+			if (this->isJson()) {
+				out << "}";
+			} else {
+				out << "\n" << Indent{frame.indentLevel} << "}";
+			}
+			stack.pop_back();
+			continue;
+		}
+
+		if (this->isJson() && frame.index > 0) {
+			out << ",";
+		}
+
+		nix::Symbol const symbol = frame.names[frame.index];
+		auto const name = static_cast<StdStr>(this->state->ctx.symbols[symbol]);
+		if (this->isJson()) {
+			printJsonString(out, name);
+			out << ":";
+		} else {
+			out << "\n" << Indent{frame.indentLevel + 1} << name << " = ";
+		}
 		this->currentAttrName = name;
-		this->printValue(value, out, indentLevel + 1, depth + 1);
+		this->currentPath.push_back(AttrPathElem{.name = name});
+		frame.itemOpen = true;
+
+		// Copy these out, since beginCursor() might push a frame of its own.
+		auto const parent = frame.cursor;
+		uint32_t const indentLevel = frame.indentLevel + 1;
+		uint32_t const depth = frame.depth + 1;
+
+		std::shared_ptr<nix::eval_cache::AttrCursor> child;
+		OptString const maybeErrorMessage = this->safely([&]() {
+			child = parent->getAttr(*this->state, symbol).get_ptr();
+		});
+		if (maybeErrorMessage.has_value()) {
+			this->printMarker(out, "error", maybeErrorMessage.value());
+			continue;
+		}
+
+		this->beginCursor(child, out, indentLevel, depth, stack);
+	}
+}
+
+void Printer::printAttrEntry(StdStr name, nix::Value &value, std::ostream &out, uint32_t indentLevel, uint32_t depth)
+{
+	if (this->isJson()) {
+		printJsonString(out, name);
+		out << ":";
+	} else {
+		out << "\n" << Indent{indentLevel + 1} << name << " = ";
+	}
+	this->currentAttrName = name;
+	this->currentPath.push_back(AttrPathElem{.name = name});
+	this->printValue(value, out, indentLevel + 1, depth + 1);
+	this->currentPath.pop_back();
+	if (!this->isJson()) {
 		out << ";";
 	}
+}
+
+bool Printer::overBudget(std::ostream &out, size_t index, StdOpt<size_t> maxItems)
+{
+	if (maxItems.has_value() && index >= maxItems.value()) {
+		return true;
+	}
+
+	if (this->budget.maxBytes.has_value()) {
+		auto const position = out.tellp();
+		// Streams that can't tell us where they are can't be held to a byte budget.
+		if (position != std::streampos(-1) && this->outputStart != std::streampos(-1)) {
+			auto const written = static_cast<size_t>(position - this->outputStart);
+			if (written >= this->budget.maxBytes.value()) {
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+void Printer::printElidedRest(std::ostream &out, size_t count, StdStr noun, bool inAttrs, uint32_t indentLevel, bool first)
+{
+	auto const what = fmt::format("{} more {}", count, maybePluralize(count, noun));
+	this->printElided(out, "elided", what, inAttrs, indentLevel, first);
+}
+
+void Printer::printElided(std::ostream &out, StdStr kind, StdStr what, bool inAttrs, uint32_t indentLevel, bool first)
+{
+	if (this->isJson()) {
+		// Lists get a marker element, attrsets get a marker attribute.
+		if (!first) {
+			out << ",";
+		}
+		if (inAttrs) {
+			printJsonString(out, fmt::format("${}", kind));
+			out << ":";
+			printJsonString(out, what);
+		} else {
+			this->printMarker(out, kind, what);
+		}
+		return;
+	}
+
+	out << "\n" << Indent{indentLevel + 1} << "«" << what << " elided»";
+}
+
+void Printer::printElidedValue(nix::Value &value, std::ostream &out)
+{
+	// Say how much we're skipping, if we can tell without forcing anything.
+	switch (value.type()) {
+		case nix::nAttrs: {
+			auto const count = value.attrs->size();
+			this->printMarker(out, "elided", fmt::format("{} {} elided", count, maybePluralize(count, "attr")));
+			break;
+		}
+		case nix::nList: {
+			auto const count = value.listSize();
+			this->printMarker(out, "elided", fmt::format("{} list {} elided", count, maybePluralize(count, "item")));
+			break;
+		}
+		default:
+			this->printMarker(out, "elided", "too deep");
+			break;
+	}
+}
+
+/** For NDJSON: the last record, when the rest of the top-level attrs are over budget.
+ * A shape of its own, since any `path` we gave it would look like a real attribute's.
+ */
+static void printElidedRecord(std::ostream &out, size_t count)
+{
+	out << fmt::format("{{\"elided\":{}}}\n", count);
+}
+
+void Printer::printRecords(nix::Value &value, std::ostream &out)
+{
+	// Records are only split at the top level, so we need to know what we're looking at first.
+	if (value.isThunk()) {
+		aboutToBlock(out);
+	}
+	OptString maybeForceErrorMessage = this->safeForce(value);
+
+	bool const splittable = !maybeForceErrorMessage.has_value()
+		&& value.type() == nix::nAttrs
+		&& !(this->shortDerivations && this->state->isDerivation(value));
+
+	if (!splittable) {
+		out << "{\"path\":[],\"value\":";
+		if (maybeForceErrorMessage.has_value()) {
+			this->printMarker(out, "error", maybeForceErrorMessage.value());
+		} else {
+			this->printValue(value, out, 0, 0);
+		}
+		out << "}\n";
+		return;
+	}
+
+	// The top-level attrset is on the path to all of its values, like with printValue(),
+	// so anything in it that refers back to it is printed as «repeated».
+	this->seen.insert(value.attrs);
+
+	this->outputStart = out.tellp();
+	size_t index = 0;
+
+	for (auto const &[name, attrValue] : AttrIterable(value.attrs, this->state->ctx.symbols)) {
+		if (this->overBudget(out, index, this->budget.maxAttrsPerSet)) {
+			printElidedRecord(out, value.attrs->size() - index);
+			break;
+		}
+		index += 1;
+
+		this->printRecord(name, attrValue, out);
+	}
+}
+
+void Printer::printRecord(StdStr name, nix::Value &value, std::ostream &out)
+{
+	out << "{\"path\":[";
+	printJsonString(out, name);
+	out << "],\"value\":";
+	this->currentAttrName = name;
+	this->currentPath.push_back(AttrPathElem{.name = name});
+	this->printValue(value, out, 1, 1);
+	this->currentPath.pop_back();
+	out << "}\n";
+}
+
+bool Printer::shardable(nix::Value &value)
+{
+	if (value.isThunk()) {
+		// Figuring out whether it's worth it may take a while.
+		if (this->safeForce(value).has_value()) {
+			return false;
+		}
+	}
+
+	// Derivations are small, and we'd want to print them differently anyway.
+	return value.type() == nix::nAttrs
+		&& !value.attrs->empty()
+		&& !this->state->isDerivation(value);
+}
+
+void Printer::printSharded(nix::Value &value, std::ostream &out, WorkerPool &pool)
+{
+	bool const records = this->format == OutputFormat::NDJSON;
+
+	// Same as the top level of printAttrs() or printRecords(), except the workers print each attribute.
+	this->outputStart = out.tellp();
+	this->seen.insert(value.attrs);
+
+	size_t const attrCount = value.attrs->size();
+	StdVec<StdString> names;
+	for (auto const &[name, attrValue] : AttrIterable(value.attrs, this->state->ctx.symbols)) {
+		if (this->budget.maxAttrsPerSet.has_value() && names.size() >= this->budget.maxAttrsPerSet.value()) {
+			break;
+		}
+		names.emplace_back(name);
+	}
+
+	if (!records) {
+		out << "{";
+	}
+
+	size_t printed = 0;
+	bool outOfBytes = false;
+	pool.run(names, [&](size_t index, StdOpt<StdString> reply) {
+		// Workers are still going to finish what they've started, but we can't print any of it.
+		if (outOfBytes || this->overBudget(out, index, std::nullopt)) {
+			outOfBytes = true;
+			return;
+		}
+
+		if (this->isJson() && !records && index > 0) {
+			out << ",";
+		}
+
+		if (reply.has_value()) {
+			// See printShard().
+			PrinterStats shardStats;
+			std::memcpy(&shardStats, reply->data(), sizeof(shardStats));
+			this->stats += shardStats;
+			out << StdStr{*reply}.substr(sizeof(shardStats));
+		} else {
+			StdStr const name = names[index];
+			StdStr const message = "xil worker died while evaluating this";
+			if (records) {
+				out << "{\"path\":[";
+				printJsonString(out, name);
+				out << "],\"value\":";
+				this->printMarker(out, "error", message);
+				out << "}\n";
+			} else {
+				if (this->isJson()) {
+					printJsonString(out, name);
+					out << ":";
+				} else {
+					out << "\n" << Indent{1} << name << " = ";
+				}
+				this->printMarker(out, "error", message);
+				if (!this->isJson()) {
+					out << ";";
+				}
+			}
+		}
+
+		printed = index + 1;
+		aboutToBlock(out);
+	});
+
+	if (printed < attrCount) {
+		if (records) {
+			printElidedRecord(out, attrCount - printed);
+		} else {
+			this->printElidedRest(out, attrCount - printed, "attr", true, 0, printed == 0);
+		}
+	}
+
+	if (!records) {
+		out << (this->isJson() ? "}" : "\n}");
+	}
+}
+
+StdString Printer::printShard(nix::Value &root, StdStr name)
+{
+	// Like printSharded(), we're printing the values of this attrset, not the attrset itself.
+	this->seen.insert(root.attrs);
+	this->stats = PrinterStats{};
+
+	std::ostringstream out;
+	this->outputStart = out.tellp();
+
+	nix::Value *value = this->getAttrValue(root.attrs, name);
+	if (value == nullptr) {
+		throw nix::Error("xil worker has no attribute '%s' to print", name);
+	}
+
+	if (this->format == OutputFormat::NDJSON) {
+		this->printRecord(name, *value, out);
+	} else {
+		this->printAttrEntry(name, *value, out, 0, 0);
+	}
+
+	// The stats this cost go in front, so the parent can add them to its own.
+	StdString reply(sizeof(PrinterStats), '\0');
+	std::memcpy(reply.data(), &this->stats, sizeof(PrinterStats));
+	reply += out.view();
+	return reply;
+}
+
+bool Printer::printBatchItem(StdStr input, nix::Value &value, std::ostream &out, bool expandDerivation)
+{
+	// With --safe, errors are caught and printed in place of whatever failed, so we can print as we go.
+	if (this->safe) {
+		this->printBatchRecord(input, &value, {}, out, expandDerivation);
+		return true;
+	}
+
+	// Otherwise one bad item still shouldn't take the rest of the batch down with it,
+	// or leave half a record behind, so print it to the side first.
+	std::ostringstream captured;
+	try {
+		this->printBatchRecord(input, &value, {}, captured, expandDerivation);
+	} catch (nix::Error &ex) {
+		this->printBatchRecord(input, nullptr, ex.msg(), out, false);
+		return false;
+	}
+	out << captured.view();
+	return true;
+}
+
+void Printer::printBatchError(StdStr input, StdStr message, std::ostream &out)
+{
+	this->printBatchRecord(input, nullptr, message, out, false);
+}
+
+void Printer::printBatchRecord(StdStr input, nix::Value *value, StdStr error, std::ostream &out, bool expandDerivation)
+{
+	// Each item is its own top-level value.
+	this->seen.clear();
+	this->currentAttrName = std::nullopt;
+	// Whatever a failed item was in the middle of.
+	this->currentPath.clear();
+
+	if (this->isJson()) {
+		out << "{\"input\":";
+		printJsonString(out, input);
+		out << ",\"value\":";
+	} else {
+		out << "# " << input << "\n";
+	}
+
+	if (value == nullptr) {
+		this->printMarker(out, "error", error);
+	} else if (expandDerivation && this->state->isDerivation(*value)) {
+		this->printAttrs(value->attrs, out, 0, 0, this->derivationFilter());
+	} else {
+		this->printValue(*value, out, 0, 0);
+	}
+
+	out << (this->isJson() ? "}\n" : "\n");
+}
+
+void Printer::printCheapDerivation(nix::Value &value, std::ostream &out, uint32_t depth)
+{
+	// Only force what's cheap: name, pname, and version are plain strings in any sane derivation,
+	// unlike drvPath, which means instantiating the whole derivation graph.
+	auto const stringAttr = [&](nix::Value *attr) -> OptString {
+		if (attr == nullptr || (attr->isThunk() && !this->mayForce(depth + 1))) {
+			return std::nullopt;
+		}
+		if (this->safeForce(*attr).has_value() || attr->type() != nix::nString) {
+			return std::nullopt;
+		}
+		return StdString{attr->str()};
+	};
+
+	OptString name = stringAttr(this->getAttrValue(value.attrs, this->state->ctx.s.name));
+	if (!name.has_value()) {
+		OptString const pname = stringAttr(this->getAttrValue(value.attrs, "pname"));
+		OptString const version = stringAttr(this->getAttrValue(value.attrs, "version"));
+		if (pname.has_value() && version.has_value()) {
+			name = fmt::format("{}-{}", pname.value(), version.value());
+		} else {
+			name = pname;
+		}
+	}
+
+	auto detail = fmt::format("derivation {}", name.value_or("???"));
+
+	// outPath costs as much as drvPath does, so only show it if someone else already paid for it.
+	nix::Value *outPath = this->getAttrValue(value.attrs, this->state->ctx.s.outPath);
+	if (outPath != nullptr && !outPath->isThunk() && outPath->type() == nix::nString) {
+		detail += fmt::format(" {}", outPath->str());
+	}
+
+	this->printMarker(out, "derivation", detail);
+}
+
+bool Printer::mayForce(uint32_t depth) const noexcept
+{
+	return !this->forceDepth.has_value() || depth <= this->forceDepth.value();
+}
+
+bool Printer::isDerivation(nix::Value &value, uint32_t depth)
+{
+	if (this->mayForce(depth + 1)) {
+		return this->state->isDerivation(value);
+	}
+
+	// Same check as nix::EvalState::isDerivation(), minus the forcing.
+	nix::Value *type = this->getAttrValue(value.attrs, this->state->ctx.s.type);
+	return type != nullptr
+		&& !type->isThunk()
+		&& type->type() == nix::nString
+		&& type->str() == "derivation"s;
+}
 
-	out << "\n" << Indent{indentLevel} << "}";
+void Printer::printFunction(nix::Value &value, std::ostream &out)
+{
+	if (value.isLambda()) {
+		out << "lambda";
+		if (value.lambda.fun != nullptr) {
+			// If our function expression's name isn't the same as the attr key we're currently in,
+			// then print `lambda NAME =`.
+			// If it has an argument name too, then that looks like `lambda NAME = ARG: …`.
+			// FIXME: make it clearer when it's an application of another function, if we can.
+			auto const functionName = this->symbolStr(value.lambda.fun->name);
+			auto const argName = this->symbolStr(value.lambda.fun->pattern->name);
+			bool const needsEquals = functionName.has_value() && functionName != this->currentAttrName;
+			auto hasFormals = [](nix::Pattern const &pat) {
+				return dynamic_cast<nix::AttrsPattern const *>(&pat) != nullptr;
+			};
+			bool const needsSpace = needsEquals || argName.has_value() || hasFormals(*value.lambda.fun->pattern);
+
+			if (needsSpace) {
+				out << " ";
+			}
+			if (needsEquals) {
+				out << functionName.value() << " = ";
+			}
+			if (argName.has_value()) {
+				out << argName.value() << ": ";
+			}
+			if (hasFormals(*value.lambda.fun->pattern)) {
+				// FIXME: print formals
+				out << "{ ";
+				auto formalToString = [&](nix::AttrsPattern::Formal const &formal) -> StdStr {
+					return this->symbolStr(formal.name).value_or("«no name?»");
+				};
+				auto &pat = dynamic_cast<nix::AttrsPattern &>(*value.lambda.fun->pattern);
+				auto formalsNames = iter::imap(formalToString, pat.formals);
+				out << fmt::format("{}", fmt::join(formalsNames, ", "));
+				if (pat.ellipsis) {
+					out << ", ...";
+				}
+				out << " }: ";
+			}
+		}
+		out << "…";
+	} else if (value.isPrimOp()) {
+		out << "primop " << value.primOp->name;
+	} else if (value.isPrimOpApp()) {
+		out << "primopApp ";
+		auto lhsName = this->valueName(*value.primOpApp.left);
+		auto rhsName = this->valueName(*value.primOpApp.right);
+		auto needsSpace = lhsName.has_value() && rhsName.has_value();
+		if (lhsName.has_value()) {
+			out << lhsName.value();
+		}
+		if (needsSpace) {
+			out << " ";
+		}
+		if (rhsName.has_value()) {
+			out << rhsName.value();
+		}
+	} else {
+		assert("unreachable" == nullptr);
+	}
 }
 
 void Printer::printValue(nix::Value &value, std::ostream &out, uint32_t indentLevel, uint32_t depth)
+{
+	if (depth == 0) {
+		this->outputStart = out.tellp();
+	}
+
+	StdVec<PrintFrame> stack;
+	this->beginValue(value, out, indentLevel, depth, stack);
+	this->printPending(stack, out);
+}
+
+void Printer::beginValue(
+	nix::Value &value,
+	std::ostream &out,
+	uint32_t indentLevel,
+	uint32_t depth,
+	StdVec<PrintFrame> &stack,
+	AttrsFilter filter
+)
 {
 	nix::checkInterrupt();
 
-	// FIXME
-	if (indentLevel > 10) {
-		out << "«early too deep»";
+	// Check this before forcing, so whatever's past the limit never gets evaluated at all.
+	if (this->budget.maxDepth.has_value() && depth > this->budget.maxDepth.value()) {
+		this->printElidedValue(value, out);
 		return;
 	}
 
@@ -342,164 +1445,119 @@ void Printer::printValue(nix::Value &value, std::ostream &out, uint32_t indentLe
 	// If there's an error, catch it and print a short version of the error.
 	// We used to only force thunks, but Nix doesn't seem to like its values
 	// being forced out of order.
-	// FIXME: make configurable.
-	OptString maybeForceErrorMessage = this->safeForce(value);
-	if (maybeForceErrorMessage.has_value()) {
-		out << "«" << maybeForceErrorMessage.value() << "»";
-		return;
+	// Past `forceDepth`, thunks are left alone, and printed as such.
+	if (this->mayForce(depth)) {
+		if (value.isThunk()) {
+			// Forcing can take arbitrarily long, so make sure what we have so far is visible.
+			aboutToBlock(out);
+		}
+		OptString maybeForceErrorMessage = this->safeForce(value);
+		if (maybeForceErrorMessage.has_value()) {
+			this->printMarker(out, "error", maybeForceErrorMessage.value());
+			return;
+		}
 	}
 
 	switch (value.type()) {
 		case nix::nThunk:
-			out << "«thunk»";
+			this->printMarker(out, "thunk", "thunk");
 			break;
 		case nix::nInt:
 			out << value.integer;
 			break;
 		case nix::nFloat:
-			out << value.fpoint;
+			if (this->isJson() && !std::isfinite(value.fpoint)) {
+				// JSON has no representation for these.
+				out << "null";
+			} else {
+				// The shortest form that reads back as the same double, not the stream's six significant digits.
+				out << fmt::format("{}", value.fpoint);
+			}
 			break;
 		case nix::nBool:
 			nix::printLiteralBool(out, value.boolean);
 			break;
 		case nix::nString:
-			out << prettyString(value.str(), indentLevel);
+			if (this->isJson()) {
+				printJsonString(out, value.str());
+			} else {
+				out << prettyString(value.str(), indentLevel);
+			}
 			break;
 		case nix::nPath:
-			out << value.path().to_string();
+			if (this->isJson()) {
+				printJsonString(out, value.path().to_string());
+			} else {
+				out << value.path().to_string();
+			}
 			break;
 		case nix::nNull:
 			out << "null";
 			break;
 		case nix::nAttrs: {
-			if (this->state->isDerivation(value) && this->shortDerivations) {
+			bool const isDerivation = this->isDerivation(value, depth);
+			// Getting the drvPath means forcing it, so we can't when we aren't forcing anything.
+			if (isDerivation && this->shortDerivations && (this->cheapDerivations || !this->mayForce(depth + 1))) {
+				this->printCheapDerivation(value, out, depth);
+				break;
+			}
+			if (isDerivation && this->shortDerivations) {
 				auto drvPath = this->getAttrValue(value.attrs, this->state->ctx.s.drvPath);
-				out << "«derivation ";
 				// We handle drvPath specially because anything other than a string
 				// should be invalid, and if it is a string then we don't want to print
 				// the quotes (which this->printValue() adds).
 				if (drvPath == nullptr) {
-					out << "???»";
+					this->printMarker(out, "derivation", "derivation ???");
 					return;
 				}
 				if (drvPath->isThunk()) {
 					OptString maybeForceErrorMessage = this->safeForce(*drvPath);
 					if (maybeForceErrorMessage.has_value()) {
-						out << "«" << maybeForceErrorMessage.value() << "»»";
+						if (this->isJson()) {
+							this->printMarker(out, "error", maybeForceErrorMessage.value());
+						} else {
+							out << "«derivation «" << maybeForceErrorMessage.value() << "»»";
+						}
 						return;
 					}
 				}
 
 				if (drvPath->type() != nix::nString) {
-					out << fmt::format("invalid {}", drvPath->type());
+					this->printMarker(out, "derivation", fmt::format("derivation invalid {}", drvPath->type()));
+				} else if (this->isJson()) {
+					this->printMarker(out, "derivation", drvPath->str());
 				} else {
-					out << drvPath->str();
+					out << "«derivation " << drvPath->str() << "»";
 				}
-				out << "»";
 
 				break;
 			}
 
-			this->printAttrs(value.attrs, out, indentLevel, depth);
+			this->openAttrs(value.attrs, out, indentLevel, depth, stack, isDerivation ? this->derivationFilter() : filter);
 
 			break;
 		}
-		case nix::nList: {
-			// FIXME: better heuristics for short lists
-			// Things like `outputs = [ "out" ]` are annoying printed multiline.
-			if (value.listSize() == 0) {
-				out << "[ ]";
-				break;
-			}
-
-			out << "[";
-			for (auto &listItem : value.listItems()) {
-				out << "\n" << Indent{indentLevel + 1};
-				std::flush(out);
-				this->printValue(*listItem, out, indentLevel + 1, depth + 1);
-			}
-
-			out << "\n" << Indent{indentLevel} << "]";
-
+		case nix::nList:
+			this->openList(value, out, indentLevel, depth, stack);
 			break;
-		}
-		case nix::nFunction:
-			if (value.isLambda()) {
-				out << "«lambda";
-				if (value.lambda.fun != nullptr) {
-					// If our function expression's name isn't the same as the attr key we're currently in,
-					// then print `lambda NAME =`.
-					// If it has an argument name too, then that looks like `lambda NAME = ARG: …`.
-					// FIXME: make it clearer when it's an application of another function, if we can.
-					auto const functionName = this->symbolStr(value.lambda.fun->name);
-					auto const argName = this->symbolStr(value.lambda.fun->pattern->name);
-					bool const needsEquals = functionName.has_value() && functionName != this->currentAttrName;
-					auto hasFormals = [](nix::Pattern const &pat) {
-						return dynamic_cast<nix::AttrsPattern const *>(&pat) != nullptr;
-					};
-					bool const needsSpace = needsEquals || argName.has_value() || hasFormals(*value.lambda.fun->pattern);
-
-					if (needsSpace) {
-						out << " ";
-					}
-					if (needsEquals) {
-						out << functionName.value() << " = ";
-					}
-					if (argName.has_value()) {
-						out << argName.value() << ": ";
-					}
-					if (hasFormals(*value.lambda.fun->pattern)) {
-						// FIXME: print formals
-						out << "{ ";
-						auto formalToString = [&](nix::AttrsPattern::Formal const &formal) {
-							auto str = this->symbolStr(formal.name);
-							if (str.has_value()) {
-								return str.value();
-							}
-							return "«no name?»"s;
-						};
-						auto &pat = dynamic_cast<nix::AttrsPattern &>(*value.lambda.fun->pattern);
-						auto formalsNames = iter::imap(formalToString, pat.formals);
-						out << fmt::format("{}", fmt::join(formalsNames, ", "));
-						if (pat.ellipsis) {
-							out << ", ...";
-						}
-						out << " }: ";
-					}
-				}
-				out << "…»";
-			} else if (value.isPrimOp()) {
-				out << "«primop " << value.primOp->name << "»";
-			} else if (value.isPrimOpApp()) {
-				out << "«primopApp ";
-				auto lhsName = this->valueName(*value.primOpApp.left);
-				auto rhsName = this->valueName(*value.primOpApp.right);
-				auto needsSpace = lhsName.has_value() && rhsName.has_value();
-				if (lhsName.has_value()) {
-					out << lhsName.value();
-				}
-				if (needsSpace) {
-					out << " ";
-				}
-				if (rhsName.has_value()) {
-					out << rhsName.value();
-				}
-				out << "»";
-			} else {
-				assert("unreachable" == nullptr);
-			}
+		case nix::nFunction: {
+			std::stringstream description;
+			this->printFunction(value, description);
+			this->printMarker(out, "function", description.str());
 			break;
+		}
 		case nix::nExternal:
-			out << "«external?»";
+			this->printMarker(out, "external", "external?");
 			break;
 	}
 }
 
 void Printer::printRepeatedAttrs(nix::Bindings *attrs, std::ostream &out)
 {
-	StdVec<StdString> firstFewNames;
+	StdVec<StdStr> firstFewNames;
 	for (auto const &[innerName, innerValue] : AttrIterable(attrs, this->state->ctx.symbols)) {
-		firstFewNames.push_back(innerName);
+		firstFewNames.emplace_back(innerName);
+		this->stats.symbolNames += 1;
 		// FIXME: make configurable.
 		if (firstFewNames.size() > 2) {
 			break;
@@ -512,57 +1570,140 @@ void Printer::printRepeatedAttrs(nix::Bindings *attrs, std::ostream &out)
 
 OptString Printer::safeForce(nix::Value &value, nix::PosIdx position)
 {
-	if (!this->safe) {
+	// Already-forced values can't take any time, so there's nothing to time out or profile.
+	if (!value.isThunk()) {
+		return this->safeForceUntimed(value, position);
+	}
+
+	if (this->profiler == nullptr) {
+		return this->safeForceWithDeadline(value, position);
+	}
+
+	auto const start = std::chrono::steady_clock::now();
+	try {
+		auto result = this->safeForceWithDeadline(value, position);
+		this->profiler->record(this->currentPath, std::chrono::steady_clock::now() - start);
+		return result;
+	} catch (...) {
+		// Still worth knowing about the time spent on something that took the whole run down with it.
+		this->profiler->record(this->currentPath, std::chrono::steady_clock::now() - start);
+		throw;
+	}
+}
+
+OptString Printer::safeForceWithDeadline(nix::Value &value, nix::PosIdx position)
+{
+	if (this->forceDeadline == nullptr) {
+		return this->safeForceUntimed(value, position);
+	}
+
+	this->forceDeadline->arm();
+	try {
+		auto result = this->safeForceUntimed(value, position);
+		// If the deadline passed right as forcing finished, we still got the value, so that's fine.
+		this->forceDeadline->disarm();
+		return result;
+	} catch (nix::Interrupted &) {
+		if (!this->forceDeadline->disarm()) {
+			// The user wants us to stop.
+			throw;
+		}
+
+		this->stats.timeouts += 1;
+		auto const seconds = std::chrono::duration<double>(this->forceDeadline->timeout).count();
+		return fmt::format("timed out after {:g}s", seconds);
+	}
+}
+
+OptString Printer::safeForceUntimed(nix::Value &value, nix::PosIdx position)
+{
+	return this->safely([&]() {
 		this->state->forceValue(value, position);
+	});
+}
+
+OptString Printer::safely(std::function<void()> const &action)
+{
+	if (!this->safe) {
+		action();
 		return std::nullopt;
 	}
 	try {
-		this->state->forceValue(value, position);
+		action();
 	} catch (nix::ThrownError &ex) {
-		auto msg = ex.msg();
+		this->stats.throws += 1;
 		if (!this->shortErrors) {
-			return msg;
+			return ex.msg();
 		}
 
-		auto throwLine = stringErrorLine(msg);
-		if (throwLine.has_value()) {
-			return fmt::format("throws: {}", throwLine.value());
+		auto const summary = errorSummary(ex);
+		if (!summary.empty()) {
+			return fmt::format("throws: {}", summary);
 		}
 		return "throws";
 	} catch (nix::AssertionError &ex) {
+		this->stats.assertionErrors += 1;
 		if (!this->shortErrors) {
 			return ex.msg();
 		}
 
-		auto errorLine = stringErrorLine(ex.msg());
-		if (errorLine.has_value()) {
-			return fmt::format("assertion error: {}", errorLine.value());
+		auto const summary = errorSummary(ex);
+		if (!summary.empty()) {
+			return fmt::format("assertion error: {}", summary);
 		}
 		return "assertion error";
 	} catch (nix::EvalError &ex) {
+		this->stats.evalErrors += 1;
 		if (!this->shortErrors) {
 			return ex.msg();
 		}
 
-		auto errorLine = stringErrorLine(ex.msg());
-		if (errorLine.has_value()) {
-			return fmt::format("eval error: {}", errorLine.value());
+		auto const summary = errorSummary(ex);
+		if (!summary.empty()) {
+			return fmt::format("eval error: {}", summary);
 		}
-		return "throws";
+		return "eval error";
 	} catch (nix::Error &ex) {
+		// Everything else, like a missing file or a failed build, which is just as much a reason not to stop printing.
+		auto const summary = errorSummary(ex);
+		bool const isIfd = summary.find("import-from-derivation") != StdString::npos;
+		if (isIfd) {
+			this->stats.ifdErrors += 1;
+		} else {
+			this->stats.otherErrors += 1;
+		}
 		if (!this->shortErrors) {
 			return ex.msg();
 		}
 
-		if (ex.msg().find("allow-import-from-derivation")) {
+		if (isIfd) {
 			return "IFD error";
 		}
-		throw;
+		if (!summary.empty()) {
+			return fmt::format("error: {}", summary);
+		}
+		return "error";
 	}
 
 	return std::nullopt;
 }
 
+void Printer::printStats() const
+{
+	auto const &stats = this->stats;
+	eprintln("errors caught while printing:");
+	eprintln("    throws:           {}", stats.throws);
+	eprintln("    assertion errors: {}", stats.assertionErrors);
+	eprintln("    eval errors:      {}", stats.evalErrors);
+	eprintln("    IFD errors:       {}", stats.ifdErrors);
+	eprintln("    other errors:     {}", stats.otherErrors);
+	eprintln("    timeouts:         {}", stats.timeouts);
+	eprintln("symbol names printed without copying: {}", stats.symbolNames);
+	if (this->dedup != nullptr) {
+		eprintln("deduplicated subtrees: {} ({} bytes saved)", this->dedup->references, this->dedup->bytesSaved);
+	}
+}
+
 constexpr InstallableMode::operator InstallableMode::Value() const noexcept
 {
 	return this->inner;
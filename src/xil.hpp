@@ -2,16 +2,22 @@
 
 #pragma once
 
+#include <cassert>
 #include <functional>
 #include <iostream>
 #include <iterator>
+#include <memory>
+#include <set>
 #include <stdexcept>
 #include <type_traits>
+#include <typeinfo>
 #include <utility>
+#include <variant>
 
 // Lix headers.
 #include <lix/config.h>
 #include <lix/libexpr/eval.hh>
+#include <lix/libexpr/eval-cache.hh>
 #include <lix/libmain/shared.hh>
 
 #include <argparse/argparse.hpp>
@@ -19,12 +25,17 @@
 #include <fmt/core.h>
 #include <fmt/ostream.h>
 
+#include "deadline.hpp"
+#include "dedup.hpp"
+#include "profile.hpp"
+#include "ptrset.hpp"
 #include "std/list.hpp"
 #include "std/optional.hpp"
 #include "std/string.hpp"
 #include "std/string_view.hpp"
 #include "std/vector.hpp"
 #include "settings.hpp"
+#include "workers.hpp"
 
 #define RANGE(a) a.begin(), a.end()
 
@@ -138,58 +149,68 @@ StdString maybePluralize(T numberOfThings, StdStr baseNoun, StdStr suffix = "s")
 using OptString = StdOpt<StdString>;
 using OptStringView = StdOpt<StdStr>;
 
-#define TYPENAME(expr) (boost::core::demangle(typeid(expr).name()))
+/** Writes a string as a JSON string literal, quotes and all. */
+void printJsonString(std::ostream &out, StdStr str);
 
-size_t const EXPR_VAR = typeid(nix::ExprVar).hash_code();
-size_t const EXPR_SELECT = typeid(nix::ExprSelect).hash_code();
-size_t const EXPR_OP_HAS_ATTR = typeid(nix::ExprOpHasAttr).hash_code();
-size_t const EXPR_ATTRS = typeid(nix::ExprAttrs).hash_code();
-size_t const EXPR_LIST = typeid(nix::ExprList).hash_code();
-size_t const EXPR_LAMBDA = typeid(nix::ExprLambda).hash_code();
-size_t const EXPR_CALL = typeid(nix::ExprCall).hash_code();
-size_t const EXPR_LET = typeid(nix::ExprLet).hash_code();
-size_t const EXPR_STRING = typeid(nix::ExprString).hash_code();
-// FIXME: more
-
-#define HANDLER(kind_constant, kind_type, lambda) { \
-	kind_constant, [&](nix::Expr &rawExpr) -> StdOpt<StdString> { \
-		auto &expr = dynamic_cast<kind_type>(rawExpr); \
-		return lambda(expr); \
-	} \
-}
+#define TYPENAME(expr) (boost::core::demangle(typeid(expr).name()))
 
-struct ExprT
+/** Converts a nix::Expr * into a std::variant of pointers to its concrete kind, so it can be std::visit'd.
+ * Kinds not listed in `KindTs` come out as std::monostate.
+ *
+ * The dispatch is a fold over exact typeid comparisons, so there's nothing to allocate,
+ * no dynamic_cast, and nothing to throw.
+ */
+template <typename ... KindTs>
+struct ExprKinds
 {
-	using VariantT = std::variant<
-		nix::ExprVar *,
-		nix::ExprCall *,
-		nix::ExprString *,
-		nix::ExprLambda *,
-		nix::ExprList *,
-		nix::ExprSelect *
-	>;
-
-	static VariantT from(nix::Expr *value)
+	using VariantT = std::variant<std::monostate, KindTs * ...>;
+
+	static VariantT from(nix::Expr *value) noexcept
 	{
-		using namespace nix;
-		std::unordered_map<size_t, VariantT> handlers = {
-			{ EXPR_VAR, dynamic_cast<ExprVar *>(value) },
-			{ EXPR_CALL, dynamic_cast<ExprCall *>(value) },
-			{ EXPR_STRING, dynamic_cast<ExprString *>(value) },
-			{ EXPR_LAMBDA, dynamic_cast<ExprLambda *>(value) },
-			{ EXPR_LIST, dynamic_cast<ExprList *>(value) },
-			{ EXPR_SELECT, dynamic_cast<ExprSelect *>(value) },
-		};
+		assert(value != nullptr);
+
+		VariantT result;
+		std::type_info const &dynamicType = typeid(*value);
 
-		try {
-			return handlers.at(typeid(*value).hash_code());
-		} catch ([[maybe_unused]] std::out_of_range &ex) {
-			eprintln("No handler for {}", TYPENAME(*value));
-			throw;
-		}
+		// The typeid match is exact, so a static_cast is all we need.
+		// Short-circuits on the first match, so list common kinds first.
+		static_cast<void>((
+			(dynamicType == typeid(KindTs) && (result = static_cast<KindTs *>(value), true)) || ...
+		));
+
+		return result;
 	}
 };
 
+// Roughly in order of how often Printer sees them.
+using ExprT = ExprKinds<
+	nix::ExprLambda,
+	nix::ExprVar,
+	nix::ExprCall,
+	nix::ExprSelect,
+	nix::ExprAttrs,
+	nix::ExprList,
+	nix::ExprString,
+	nix::ExprLet,
+	nix::ExprWith,
+	nix::ExprIf,
+	nix::ExprAssert,
+	nix::ExprOpHasAttr,
+	nix::ExprOpUpdate,
+	nix::ExprOpConcatLists,
+	nix::ExprConcatStrings,
+	nix::ExprOpNot,
+	nix::ExprOpEq,
+	nix::ExprOpNEq,
+	nix::ExprOpAnd,
+	nix::ExprOpOr,
+	nix::ExprOpImpl,
+	nix::ExprInt,
+	nix::ExprFloat,
+	nix::ExprPath,
+	nix::ExprPos
+>;
+
 template<typename... Ts>
 struct overloaded : Ts... { using Ts::operator()...; };
 template<typename... Ts>
@@ -272,14 +293,183 @@ struct Indent
 	friend std::ostream &operator<<(std::ostream &out, Indent const &self);
 };
 
+/** Counters for what Printer ran into during a run, for --stats. */
+struct PrinterStats
+{
+	// Errors safeForce caught (and so kept from aborting the print), by kind.
+	size_t throws = 0;
+	size_t assertionErrors = 0;
+	size_t evalErrors = 0;
+	size_t ifdErrors = 0;
+	// Any other nix::Error, like a missing file or a failed build.
+	size_t otherErrors = 0;
+	// Values that took longer than --attr-timeout to force.
+	size_t timeouts = 0;
+
+	// Attr names, lambda names and formals printed as views into the SymbolTable,
+	// each of which used to be copied into a new string first.
+	size_t symbolNames = 0;
+
+	PrinterStats &operator+=(PrinterStats const &other) noexcept
+	{
+		this->throws += other.throws;
+		this->assertionErrors += other.assertionErrors;
+		this->evalErrors += other.evalErrors;
+		this->ifdErrors += other.ifdErrors;
+		this->otherErrors += other.otherErrors;
+		this->timeouts += other.timeouts;
+		this->symbolNames += other.symbolNames;
+		return *this;
+	}
+};
+
+/** Limits on how much Printer will print. Unset means unlimited.
+ * These are all checked before the value in question is forced, so anything over budget
+ * never gets evaluated at all.
+ */
+struct PrintBudget
+{
+	// How many attrsets and lists deep to go.
+	StdOpt<uint32_t> maxDepth = 10;
+	StdOpt<size_t> maxAttrsPerSet;
+	StdOpt<size_t> maxListItems;
+	// Total output size, after which everything not yet printed is elided.
+	StdOpt<size_t> maxBytes;
+};
+
+/** What syntax Printer writes values in. */
+enum class OutputFormat
+{
+	// Pretty, Nix-like syntax.
+	NIX,
+	// A single JSON document.
+	JSON,
+	// One JSON record per line, per top-level attribute.
+	NDJSON,
+};
+
+/** Parses the argument to --format. */
+OutputFormat parseOutputFormat(StdStr name);
+
+/** Which attrsets Printer prints as `«repeated»` instead of printing them again. */
+enum class RepeatScope
+{
+	// Only ones that contain themselves, i.e. actual cycles.
+	PATH,
+	// Any that have already been printed anywhere.
+	GLOBAL,
+};
+
+RepeatScope parseRepeatScope(StdStr name);
+
+/** For --view: changes to how things are displayed that Printer makes as it goes,
+ * rather than by building new Nix values to print (like xillib's cleanupDrv and drvListByName do).
+ */
+struct PrintView
+{
+	// Derivations printed in full skip `drvAttrs` and empty lists, and get a shorter `meta`, like cleanupDrv.
+	bool cleanup = false;
+	// Lists of derivations are printed as attrsets, keyed by each item's `pname` or `name`, like drvListByName.
+	bool byName = false;
+};
+
+/** Which of an attrset's attrs `PrintView::cleanup` skips. */
+enum class AttrsFilter : uint8_t
+{
+	NONE,
+	// A derivation: no `drvAttrs`, no empty lists, and `meta` is SHORT_META.
+	CLEAN_DERIVATION,
+	// A derivation's `meta`: no `platforms` or `maintainers`, and `license` is LICENSE_SPDX.
+	SHORT_META,
+	// A derivation's `meta.license`: only `spdxId`.
+	LICENSE_SPDX,
+};
+
+/** An attrset or list that Printer is partway through printing.
+ * Printer keeps a stack of these instead of recursing, so how deep a value can be printed
+ * isn't limited by the C++ stack, and printing can be stopped and picked back up between any two items.
+ */
+struct PrintFrame
+{
+	// Exactly one of these is set.
+	nix::Bindings *attrs = nullptr;
+	nix::Value *list = nullptr;
+
+	// The item we're on, and how many there are.
+	size_t index = 0;
+	size_t count = 0;
+
+	// Of the attrset or list itself. Its items are one deeper.
+	uint32_t indentLevel = 0;
+	uint32_t depth = 0;
+
+	// Whether the item at `index` has been started, and so needs finishing when we come back to it.
+	bool itemOpen = false;
+
+	// Where in `Printer::dedup`'s buffer this started, if we're deduplicating.
+	size_t outputOffset = 0;
+
+	// For --view cleanup, which attrs not to print, and how many of the first `index` weren't.
+	AttrsFilter filter = AttrsFilter::NONE;
+	size_t skipped = 0;
+
+	// For --view by-name, a list being printed as an attrset.
+	bool byName = false;
+
+	// For --view by-name, the names taken so far, and which one the item at `index` got.
+	// Like listToAttrs, the first item with a name gets it, and the rest are counted in `duplicates` and skipped.
+	// A set, so `itemKey` (and `Printer::currentPath`) can point into it even as the stack moves frames around.
+	std::set<StdString> byNameKeys;
+	StdStr itemKey;
+	size_t duplicates = 0;
+
+	[[nodiscard]]
+	bool isAttrs() const noexcept
+	{
+		return this->attrs != nullptr;
+	}
+
+	/** Whether this is printed with attrset syntax, which by-name lists are too. */
+	[[nodiscard]]
+	bool printsAsAttrs() const noexcept
+	{
+		return this->isAttrs() || this->byName;
+	}
+};
+// Otherwise growing the stack would copy frames, and leave `itemKey` pointing into the old ones.
+static_assert(std::is_nothrow_move_constructible_v<PrintFrame>);
+
+/** Like PrintFrame, but for an attrset being printed through the flake eval cache. */
+struct CursorFrame
+{
+	std::shared_ptr<nix::eval_cache::AttrCursor> cursor;
+
+	// Its attribute names, as the eval cache has them (sorted by name).
+	StdVec<nix::Symbol> names;
+
+	size_t index = 0;
+	uint32_t indentLevel = 0;
+	uint32_t depth = 0;
+	bool itemOpen = false;
+};
+
 struct Printer
 {
 	std::shared_ptr<nix::EvalState> state;
 
-	std::set<nix::Bindings *> seen;
+	/** Attrsets that'll be printed as `«repeated»`: either the ones enclosing what's currently being printed,
+	 * or everything printed so far, depending on `repeatScope`.
+	 */
+	PointerSet seen;
+
+	RepeatScope repeatScope = RepeatScope::PATH;
 
-	/** Used by function printing to be Smart™. */
-	OptString currentAttrName = std::nullopt;
+	PrintView view;
+
+	/** Used by function printing to be Smart™.
+	 * Points into the SymbolTable, so it stays valid for the lifetime of `state`.
+	 */
+	OptStringView currentAttrName = std::nullopt;
 
 	/** Catch errors during evaluation instead of aborting. */
 	bool safe;
@@ -290,16 +480,83 @@ struct Printer
 	/** Print derivations as their drvPaths. */
 	bool shortDerivations;
 
-	explicit Printer(std::shared_ptr<nix::EvalState> state, bool safe, bool shortErrors, bool shortDerivations) :
-		state(std::move(state)), safe(safe), shortErrors(shortErrors), shortDerivations(shortDerivations)
-	{ }
+	/** With `shortDerivations`, print derivations by name instead, since drvPath instantiates them. */
+	bool cheapDerivations = false;
+
+	/** If set, only values this many attrsets and lists deep (or less) are forced.
+	 * Anything deeper that hasn't already been evaluated is printed as `«thunk»`.
+	 */
+	StdOpt<uint32_t> forceDepth = std::nullopt;
+
+	OutputFormat format;
+
+	PrinterStats stats;
+
+	PrintBudget budget;
+
+	/** If set, how long forcing any one value is allowed to take. */
+	std::unique_ptr<ForceDeadline> forceDeadline;
 
-	// Gets a StdString for a nix::Symbol, checking if the Symbol is invalid first.
-	OptString symbolStr(nix::Symbol const &symbol);
+	/** Path from the value being printed to the one currently being printed. */
+	StdVec<AttrPathElem> currentPath;
+
+	/** If set, records how long every force takes, by `currentPath`. */
+	std::unique_ptr<EvalProfiler> profiler;
+
+	/** If set, attrsets and lists identical to ones already printed are printed as references to them instead.
+	 * Only applies to what's printed into its buffer.
+	 */
+	std::unique_ptr<SubtreeDedup> dedup;
+
+	/** Where in the output stream the current top-level print started, for `budget.maxBytes`. */
+	std::streampos outputStart = -1;
+
+	/** `_type`, interned once so checking for it is a binary search. */
+	nix::Symbol typeSymbol;
+
+	/** Attr names `view` looks for, interned once for the same reason. */
+	struct
+	{
+		nix::Symbol drvAttrs;
+		nix::Symbol platforms;
+		nix::Symbol maintainers;
+		nix::Symbol license;
+		nix::Symbol spdxId;
+		nix::Symbol pname;
+	} viewSymbols;
+
+	explicit Printer(
+		std::shared_ptr<nix::EvalState> state,
+		bool safe,
+		bool shortErrors,
+		bool shortDerivations,
+		OutputFormat format = OutputFormat::NIX
+	) :
+		state(std::move(state)), safe(safe), shortErrors(shortErrors), shortDerivations(shortDerivations), format(format)
+	{
+		this->typeSymbol = this->state->ctx.symbols.create("_type");
+
+		auto &symbols = this->state->ctx.symbols;
+		this->viewSymbols = {
+			.drvAttrs = symbols.create("drvAttrs"),
+			.platforms = symbols.create("platforms"),
+			.maintainers = symbols.create("maintainers"),
+			.license = symbols.create("license"),
+			.spdxId = symbols.create("spdxId"),
+			.pname = symbols.create("pname"),
+		};
+	}
+
+	[[nodiscard]]
+	bool isJson() const noexcept
+	{
+		return this->format != OutputFormat::NIX;
+	}
 
-	// Gets a StdStr for a nix::Symbol.
-	// TODO: Is this...safe?
-	OptStringView symbolStrView(nix::Symbol &symbol);
+	// Gets the name of a nix::Symbol, checking if the Symbol is invalid first.
+	// This is a view into the SymbolTable, which never moves or frees its strings,
+	// so it's valid for as long as `state` is, and getting it doesn't allocate.
+	OptStringView symbolStr(nix::Symbol const &symbol);
 
 	// Gets a nix::SymbolStr for a nix::Symbol, checking if the Symbol is invalid first.
 	StdOpt<nix::SymbolStr> symbol(nix::Symbol &&symbol);
@@ -309,7 +566,7 @@ struct Printer
 
 	// Gets the name associated with an expression, if applicable.
 	// Currently only applies to `ExprVar`s and `ExprLambda`s.
-	OptString exprName(nix::Expr *expr);
+	OptStringView exprName(nix::Expr *expr);
 
 	// Gets the name associated with a value, if applicable.
 	// Currently only applies to lambdas, primops, and applications of primops.
@@ -317,11 +574,174 @@ struct Printer
 
 	void printValue(nix::Value &value, std::ostream &out, uint32_t indentLevel, uint32_t depth);
 
-	void printAttrs(nix::Bindings *attrs, std::ostream &out, uint32_t indentLevel, uint32_t depth);
+	void printAttrs(
+		nix::Bindings *attrs,
+		std::ostream &out,
+		uint32_t indentLevel,
+		uint32_t depth,
+		AttrsFilter filter = AttrsFilter::NONE
+	);
+
+	/** Prints `value` if it's a leaf. If it's an attrset or list, prints its opening and pushes it onto `stack` instead.
+	 * `filter` applies if it's an attrset.
+	 */
+	void beginValue(
+		nix::Value &value,
+		std::ostream &out,
+		uint32_t indentLevel,
+		uint32_t depth,
+		StdVec<PrintFrame> &stack,
+		AttrsFilter filter = AttrsFilter::NONE
+	);
+	void openAttrs(
+		nix::Bindings *attrs,
+		std::ostream &out,
+		uint32_t indentLevel,
+		uint32_t depth,
+		StdVec<PrintFrame> &stack,
+		AttrsFilter filter = AttrsFilter::NONE
+	);
+	void openList(nix::Value &list, std::ostream &out, uint32_t indentLevel, uint32_t depth, StdVec<PrintFrame> &stack);
+
+	/** Prints the rest of everything on `stack`, until it's empty. */
+	void printPending(StdVec<PrintFrame> &stack, std::ostream &out);
+
+	/** How `view` says to filter a derivation that's being printed in full. */
+	[[nodiscard]]
+	AttrsFilter derivationFilter() const noexcept;
+
+	/** Whether `frame.filter` says to skip the item at `frame.index`,
+	 * or for --view by-name, whether an earlier item already took its name.
+	 */
+	bool skipItem(PrintFrame &frame);
+
+	/** For --view by-name: whether `list` is all derivations, and so gets printed keyed by name.
+	 * Any other list, like `outputs = [ "out" ]`, is still printed as a list.
+	 */
+	bool isDerivationList(nix::Value &list, uint32_t depth);
+
+	/** For --view by-name: what to call `item` of a list, from its `pname` or `name`. */
+	OptString byNameKey(nix::Value &item, uint32_t depth);
+
+	/** Prints a value through its flake eval cache cursor, instead of as a nix::Value.
+	 * Strings, ints, bools, lists of strings, attribute names, derivations' drvPaths, and failures are all read
+	 * from the eval cache if they're there, and stored in it if they aren't, so printing the same thing again
+	 * doesn't evaluate anything. Anything else the eval cache doesn't keep (other lists, functions, …)
+	 * is forced and printed like printValue() would.
+	 * `expandDerivation` prints a top-level derivation in full even with `shortDerivations`.
+	 */
+	void printCursor(std::shared_ptr<nix::eval_cache::AttrCursor> const &cursor, std::ostream &out, bool expandDerivation);
+
+	/** Like beginValue(), for printCursor(). */
+	void beginCursor(
+		std::shared_ptr<nix::eval_cache::AttrCursor> const &cursor,
+		std::ostream &out,
+		uint32_t indentLevel,
+		uint32_t depth,
+		StdVec<CursorFrame> &stack,
+		bool expandDerivation = false
+	);
+
+	/** Like printPending(), for printCursor(). */
+	void printPendingCursors(StdVec<CursorFrame> &stack, std::ostream &out);
+
+	/** Prints `cursor` if it's a string, int, bool, or list of strings, returning false if it's none of those. */
+	bool printCursorLeaf(nix::eval_cache::AttrCursor &cursor, std::ostream &out, uint32_t indentLevel);
+
+	/** Prints a list of strings the eval cache had for us, like printValue() would've printed the list. */
+	void printCursorStrings(StdVec<StdString> const &strings, std::ostream &out, uint32_t indentLevel);
+
+	/** The string attribute `name` of `cursor`, if it has one. */
+	OptString cursorStringAttr(nix::eval_cache::AttrCursor &cursor, nix::Symbol name);
+
+	/** Whether `out` is where `dedup` is looking. */
+	[[nodiscard]]
+	bool isDeduplicating(std::ostream const &out) const noexcept;
+
+	/** Where the next thing printed to `out` will start, for `PrintFrame::outputOffset`. */
+	[[nodiscard]]
+	size_t dedupOffset(std::ostream const &out) const noexcept;
 	void printRepeatedAttrs(nix::Bindings *attrs, std::ostream &out);
 
-	/** Attempt to force a value, returning a string for the kind of error if any. */
+	/** Prints one `name = value;` of an attrset at `indentLevel` and `depth`, or `"name":value` for JSON. */
+	void printAttrEntry(StdStr name, nix::Value &value, std::ostream &out, uint32_t indentLevel, uint32_t depth);
+
+	/** Describes a function, like `lambda x: …` or `primop map`, for printMarker() to wrap. */
+	void printFunction(nix::Value &value, std::ostream &out);
+
+	/** Prints a derivation as `«derivation NAME»` for `cheapDerivations`, without forcing its drvPath.
+	 * Also shows its outPath, if something else already forced that.
+	 */
+	void printCheapDerivation(nix::Value &value, std::ostream &out, uint32_t depth);
+
+	/** Whether `forceDepth` lets us force a value `depth` deep. */
+	[[nodiscard]]
+	bool mayForce(uint32_t depth) const noexcept;
+
+	/** `state->isDerivation()`, except only forcing the `type` attribute if `mayForce(depth + 1)`. */
+	bool isDerivation(nix::Value &value, uint32_t depth);
+
+	/** For NDJSON: prints one record per attribute of a top-level attrset, as each one is evaluated.
+	 * If the output budget runs out first, the last line is `{"elided":N}` instead of a record.
+	 */
+	void printRecords(nix::Value &value, std::ostream &out);
+	void printRecord(StdStr name, nix::Value &value, std::ostream &out);
+
+	/** Whether `value` is an attrset worth having a WorkerPool print, forcing it if need be. */
+	bool shardable(nix::Value &value);
+
+	/** For --jobs: prints a top-level attrset like printAttrs() (or printRecords() for NDJSON) would,
+	 * except each attribute is evaluated and printed by one of `pool`'s workers, each running `printShard()`.
+	 */
+	void printSharded(nix::Value &value, std::ostream &out, WorkerPool &pool);
+
+	/** In a --jobs worker, prints attribute `name` of `root` for `printSharded()`. */
+	StdString printShard(nix::Value &root, StdStr name);
+
+	/** For --batch: prints the result of one input line, as a `# INPUT` line followed by the value for Nix syntax,
+	 * or as a single `{"input": …, "value": …}` line for JSON.
+	 * `expandDerivation` prints a top-level derivation in full even with `shortDerivations`.
+	 * Returns false if printing failed partway through, in which case the error is printed instead of the value.
+	 */
+	bool printBatchItem(StdStr input, nix::Value &value, std::ostream &out, bool expandDerivation);
+
+	/** For --batch: prints an input line that couldn't even be evaluated, the same way as `printBatchItem()`. */
+	void printBatchError(StdStr input, StdStr message, std::ostream &out);
+
+	/** Shared by the above. `value` is nullptr if there's only an `error` to print. */
+	void printBatchRecord(StdStr input, nix::Value *value, StdStr error, std::ostream &out, bool expandDerivation);
+
+	/** Whether the `index`th item of an attrset or list (limited to `maxItems`) is over budget. */
+	bool overBudget(std::ostream &out, size_t index, StdOpt<size_t> maxItems);
+
+	/** Marks the last `count` items of an attrset or list as elided. */
+	void printElidedRest(std::ostream &out, size_t count, StdStr noun, bool inAttrs, uint32_t indentLevel, bool first);
+
+	/** Marks some of an attrset's or list's items as left out, because of `what`.
+	 * As `«what elided»` for Nix syntax, and for JSON as a `$kind` attribute or marker item.
+	 */
+	void printElided(std::ostream &out, StdStr kind, StdStr what, bool inAttrs, uint32_t indentLevel, bool first);
+
+	/** Marks a value as elided, with how big it is if that's known without forcing it. */
+	void printElidedValue(nix::Value &value, std::ostream &out);
+
+	/** Prints something that isn't a plain value, like an error or an elided subtree.
+	 * As `«detail»` for Nix syntax, and as `{"$kind": "detail"}` for JSON.
+	 */
+	void printMarker(std::ostream &out, StdStr kind, StdStr detail);
+
+	/** Attempt to force a value, returning a string for the kind of error if any.
+	 * With a `forceDeadline`, forcing that takes too long is interrupted and reported like an error.
+	 */
 	OptString safeForce(nix::Value &value, nix::PosIdx position = nix::noPos);
+	OptString safeForceWithDeadline(nix::Value &value, nix::PosIdx position);
+	OptString safeForceUntimed(nix::Value &value, nix::PosIdx position);
+
+	/** Runs `action`, catching the same errors safeForceUntimed() does, and returning a string for the kind of error if any. */
+	OptString safely(std::function<void()> const &action);
+
+	/** Prints `stats` to stderr. */
+	void printStats() const;
 };
 
 // Represents the different "modes" that installables can be referenced in.